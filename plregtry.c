@@ -33,12 +33,20 @@
     POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <SWI-Stream.h>
 #include <SWI-Prolog.h>
 #include <windows.h>
 #include <shlobj.h>
 #include <malloc.h>
 #include <assert.h>
 #include <limits.h>
+#include <ctype.h>
+#include <stdio.h>
+#include "regtrace.h"
+
+#ifndef EOS
+#define EOS '\0'
+#endif
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 This file serves two purposes. It  both   provides  a  reasonable set of
@@ -72,10 +80,43 @@ static atom_t ATOM_read;
 static atom_t ATOM_set_value;
 static atom_t ATOM_write;
 static atom_t ATOM_volatile;
+static atom_t ATOM_atom;
+static atom_t ATOM_string;
+static atom_t ATOM_binary;
+static atom_t ATOM_sz;
+static atom_t ATOM_expand_sz;
+static atom_t ATOM_merge;
+static atom_t ATOM_skip;
+static atom_t ATOM_overwrite;
+static atom_t ATOM_missing;
 
 static functor_t FUNCTOR_binary1;
 static functor_t FUNCTOR_link1;
 static functor_t FUNCTOR_expand1;
+static functor_t FUNCTOR_output1;
+static functor_t FUNCTOR_write1;
+static functor_t FUNCTOR_layout2;
+static functor_t FUNCTOR_threads1;
+static functor_t FUNCTOR_top1;
+static functor_t FUNCTOR_depth1;
+static functor_t FUNCTOR_if_exists1;
+static functor_t FUNCTOR_divide2;
+static functor_t FUNCTOR_minus2;
+static functor_t FUNCTOR_value1;
+static functor_t FUNCTOR_force1;
+static functor_t FUNCTOR_volatile1;
+static functor_t FUNCTOR_buffer_size1;
+static functor_t FUNCTOR_root1;
+static functor_t FUNCTOR_speedup1;
+static functor_t FUNCTOR_id1;
+static functor_t FUNCTOR_initial1;
+static functor_t FUNCTOR_registry_change2;
+static functor_t FUNCTOR_key_added1;
+static functor_t FUNCTOR_key_deleted1;
+static functor_t FUNCTOR_value_added3;
+static functor_t FUNCTOR_value_changed3;
+static functor_t FUNCTOR_value_deleted2;
+static functor_t FUNCTOR_watch_error1;
 
 static void
 init_constants()
@@ -94,24 +135,84 @@ init_constants()
   ATOM_set_value	  = PL_new_atom("set_value");
   ATOM_write		  = PL_new_atom("write");
   ATOM_volatile		  = PL_new_atom("volatile");
-
-  FUNCTOR_binary1	  = PL_new_functor(PL_new_atom("binary"), 1);
+  ATOM_atom		  = PL_new_atom("atom");
+  ATOM_string		  = PL_new_atom("string");
+  ATOM_binary		  = PL_new_atom("binary");
+  ATOM_sz		  = PL_new_atom("sz");
+  ATOM_expand_sz	  = PL_new_atom("expand_sz");
+  ATOM_merge		  = PL_new_atom("merge");
+  ATOM_skip		  = PL_new_atom("skip");
+  ATOM_overwrite	  = PL_new_atom("overwrite");
+  ATOM_missing		  = PL_new_atom("missing");
+
+  FUNCTOR_binary1	  = PL_new_functor(ATOM_binary, 1);
   FUNCTOR_link1		  = PL_new_functor(PL_new_atom("link"), 1);
   FUNCTOR_expand1	  = PL_new_functor(PL_new_atom("expand"), 1);
+  FUNCTOR_output1	  = PL_new_functor(PL_new_atom("output"), 1);
+  FUNCTOR_write1	  = PL_new_functor(ATOM_write, 1);
+  FUNCTOR_layout2	  = PL_new_functor(PL_new_atom("layout"), 2);
+  FUNCTOR_threads1	  = PL_new_functor(PL_new_atom("threads"), 1);
+  FUNCTOR_top1		  = PL_new_functor(PL_new_atom("top"), 1);
+  FUNCTOR_depth1	  = PL_new_functor(PL_new_atom("depth"), 1);
+  FUNCTOR_if_exists1	  = PL_new_functor(PL_new_atom("if_exists"), 1);
+  FUNCTOR_divide2	  = PL_new_functor(PL_new_atom("/"), 2);
+  FUNCTOR_minus2	  = PL_new_functor(PL_new_atom("-"), 2);
+  FUNCTOR_value1	  = PL_new_functor(PL_new_atom("value"), 1);
+  FUNCTOR_force1	  = PL_new_functor(PL_new_atom("force"), 1);
+  FUNCTOR_volatile1	  = PL_new_functor(ATOM_volatile, 1);
+  FUNCTOR_buffer_size1	  = PL_new_functor(PL_new_atom("buffer_size"), 1);
+  FUNCTOR_root1		  = PL_new_functor(PL_new_atom("root"), 1);
+  FUNCTOR_speedup1	  = PL_new_functor(PL_new_atom("speedup"), 1);
+  FUNCTOR_id1		  = PL_new_functor(PL_new_atom("id"), 1);
+  FUNCTOR_initial1	  = PL_new_functor(PL_new_atom("initial"), 1);
+  FUNCTOR_registry_change2 = PL_new_functor(PL_new_atom("registry_change"), 2);
+  FUNCTOR_key_added1	  = PL_new_functor(PL_new_atom("key_added"), 1);
+  FUNCTOR_key_deleted1	  = PL_new_functor(PL_new_atom("key_deleted"), 1);
+  FUNCTOR_value_added3	  = PL_new_functor(PL_new_atom("value_added"), 3);
+  FUNCTOR_value_changed3  = PL_new_functor(PL_new_atom("value_changed"), 3);
+  FUNCTOR_value_deleted2  = PL_new_functor(PL_new_atom("value_deleted"), 2);
+  FUNCTOR_watch_error1	  = PL_new_functor(PL_new_atom("watch_error"), 1);
 }
 
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-Just a function to translate  a  Windows   error  code  to a message. It
-exploits the static nature of  Prolog   atoms  to avoid storing multiple
-copies of the same message.
+Just a function to translate a Windows   error code to a message. Older
+versions interned each message as  a   permanent  atom. Scanning a large
+hive can raise many errors, so we  now   keep  the  text of the last few
+distinct messages in a small  round-robin   cache  and  copy the message
+into a buffer supplied by the caller.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
+#define MSG_CACHE_SIZE	8
+#define MSG_MAX_LEN	256
+
+typedef struct msg_cache_entry
+{ DWORD	id;				/* Windows error code */
+  int	valid;				/* entry is in use */
+  char	text[MSG_MAX_LEN];		/* formatted message */
+} msg_cache_entry;
+
+static msg_cache_entry msg_cache[MSG_CACHE_SIZE];
+static int msg_cache_next = 0;
+static CRITICAL_SECTION msg_cache_lock;
+
 static const char *
-APIError(DWORD id)
+APIError(DWORD id, char *buf, size_t size)
 { char *msg;
   static WORD lang;
   static int lang_initialised = 0;
+  int i;
+
+  EnterCriticalSection(&msg_cache_lock);
+  for(i=0; i<MSG_CACHE_SIZE; i++)
+  { if ( msg_cache[i].valid && msg_cache[i].id == id )
+    { strncpy(buf, msg_cache[i].text, size-1);
+      buf[size-1] = EOS;
+      LeaveCriticalSection(&msg_cache_lock);
+      return buf;
+    }
+  }
+  LeaveCriticalSection(&msg_cache_lock);
 
   if ( !lang_initialised )
     lang = MAKELANGID(LANG_ENGLISH, SUBLANG_ENGLISH_UK);
@@ -126,12 +227,23 @@ again:
 		     (LPTSTR) &msg,
 		     0,				/* size */
 		     NULL) )			/* arguments */
-  { atom_t a = PL_new_atom(msg);
-
+  { msg_cache_entry *e;
+
+    EnterCriticalSection(&msg_cache_lock);
+    e = &msg_cache[msg_cache_next];
+    msg_cache_next = (msg_cache_next+1) % MSG_CACHE_SIZE;
+    e->id = id;
+    e->valid = TRUE;
+    strncpy(e->text, msg, MSG_MAX_LEN-1);
+    e->text[MSG_MAX_LEN-1] = EOS;
+    LeaveCriticalSection(&msg_cache_lock);
+
+    strncpy(buf, msg, size-1);
+    buf[size-1] = EOS;
     LocalFree(msg);
     lang_initialised = 1;
 
-    return PL_atom_chars(a);
+    return buf;
   } else
   { if ( lang_initialised == 0 )
     { lang = MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT);
@@ -159,16 +271,26 @@ again:
 
 #include <winerror.h>
 
+/* Raise an exception for a failed API call.  If msg is not NULL it is
+   used as message in the context instead of the system message.
+*/
+
 static int
-api_exception(DWORD err, const char *action, term_t key)
+api_exception_context(DWORD err, const char *action, term_t key,
+		      const char *msg)
 { term_t except = PL_new_term_ref();
   term_t formal = PL_new_term_ref();
   term_t swi	= PL_new_term_ref();
-  const char *msg = NULL;
+  char msgbuf[MSG_MAX_LEN];
   int rc;
 
   switch(err)
-  { case ERROR_ACCESS_DENIED:
+  { case ERROR_PRIVILEGE_NOT_HELD:	/* add the message to tell it apart */
+    case ERROR_NOT_ALL_ASSIGNED:	/* from access to the key */
+      if ( !msg )
+	msg = APIError(err, msgbuf, sizeof(msgbuf));
+      /*FALLTHROUGH*/
+    case ERROR_ACCESS_DENIED:
     { rc = PL_unify_term(formal,
 			 CompoundArg("permission_error", 3),
 			 AtomArg(action),
@@ -178,7 +300,8 @@ api_exception(DWORD err, const char *action, term_t key)
     }
     default:
       rc = PL_unify_atom_chars(formal, "system_error");
-      msg = APIError(err);
+      if ( !msg )
+	msg = APIError(err, msgbuf, sizeof(msgbuf));
       break;
   }
 
@@ -186,7 +309,7 @@ api_exception(DWORD err, const char *action, term_t key)
   { term_t msgterm  = PL_new_term_ref();
 
     if ( msg )
-    { PL_put_atom_chars(msgterm, msg);
+    { PL_put_string_chars(msgterm, msg);
     }
 
     rc = PL_unify_term(swi,
@@ -208,6 +331,11 @@ api_exception(DWORD err, const char *action, term_t key)
   return rc;
 }
 
+static int
+api_exception(DWORD err, const char *action, term_t key)
+{ return api_exception_context(err, action, key, NULL);
+}
+
 
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 Translate a term, that  is  either  an   atom,  indicating  one  of  the
@@ -240,8 +368,58 @@ to_key(term_t h)
 }
 
 
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Options shared by the predicates that   return  registry text. Returning
+key names, value names and string values as atoms puts a lot of pressure
+on the atom table when scanning  large   hives.  The option output(Type),
+where Type is one of `atom` (default)   or  `string` selects the Prolog
+type used. Unknown options are ignored.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct reg_options
+{ int	text_type;			/* PL_ATOM or PL_STRING */
+} reg_options;
+
+static const reg_options default_options = { PL_ATOM };
+
+static int
+get_reg_options(term_t options, reg_options *opts)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  *opts = default_options;
+  while(PL_get_list(tail, head, tail))
+  { if ( PL_is_functor(head, FUNCTOR_output1) )
+    { atom_t a;
+
+      _PL_get_arg(1, head, arg);
+      if ( !PL_get_atom(arg, &a) )
+	return PL_type_error("atom", arg);
+      if ( a == ATOM_atom )
+	opts->text_type = PL_ATOM;
+      else if ( a == ATOM_string )
+	opts->text_type = PL_STRING;
+      else
+	return PL_domain_error("output", arg);
+    }
+  }
+  if ( !PL_get_nil(tail) )
+    return PL_type_error("list", options);
+
+  return TRUE;
+}
+
+
+static int
+unify_text(term_t t, const char *s, const reg_options *opts)
+{ return PL_unify_chars(t, opts->text_type, (size_t)-1, s);
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 reg_subkeys(+Super, -Subs)
+reg_subkeys(+Super, -Subs, +Options)
 	Return list of keys below Super.  The list of keys is of the
 	form key(KeyName, KeyClass).
 
@@ -254,8 +432,8 @@ think this predicate succeeded with the empty list. `head' is just a new
 term reference, used for handling the various cells.
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-foreign_t
-pl_reg_subkeys(term_t h, term_t l)
+static foreign_t
+reg_subkeys(term_t h, term_t l, const reg_options *opts)
 { HKEY k = to_key(h);
   int i;
   term_t tail = PL_copy_term_ref(l);
@@ -275,7 +453,7 @@ pl_reg_subkeys(term_t h, term_t l)
     rval = RegEnumKeyEx(k, i, kname, (LPDWORD)&sk, NULL, cname, (LPDWORD)&sc, &t);
     if ( rval == ERROR_SUCCESS )
     { if ( PL_unify_list(tail, head, tail) &&
-	   PL_unify_atom_chars(head, kname) )
+	   unify_text(head, kname, opts) )
 	continue;
       else
 	PL_fail;			/* close key? */
@@ -288,6 +466,23 @@ pl_reg_subkeys(term_t h, term_t l)
 }
 
 
+foreign_t
+pl_reg_subkeys(term_t h, term_t l)
+{ return reg_subkeys(h, l, &default_options);
+}
+
+
+foreign_t
+pl_reg_subkeys3(term_t h, term_t l, term_t options)
+{ reg_options opts;
+
+  if ( !get_reg_options(options, &opts) )
+    PL_fail;
+
+  return reg_subkeys(h, l, &opts);
+}
+
+
 /* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 Maybe better in a table ...
 - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
@@ -406,252 +601,1332 @@ pl_reg_delete_key(term_t h, term_t sub)
 }
 
 		 /*******************************
-		 *	       VALUE		*
+		 *	      BUFFERS		*
 		 *******************************/
 
-foreign_t
-pl_reg_value_names(term_t h, term_t names)
-{ HKEY k;
-  DWORD rval;
-  term_t tail = PL_copy_term_ref(names);
-  term_t head = PL_new_term_ref();
-  DWORD i;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+A simple growing byte buffer. Used  for   value  data  whose size is not
+known in advance, i.e., where the  alloca()   trick  of pl_reg_value() is
+not appropriate because the data lives longer than the foreign call.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  if ( !(k = to_key(h)) )
-    PL_fail;
+typedef struct regbuf
+{ BYTE	*base;				/* allocated data */
+  size_t size;				/* used bytes */
+  size_t allocated;			/* allocated bytes */
+} regbuf;
 
-  for(i=0;;i++)
-  { char name[256];
-    DWORD sizen = sizeof(name);
+static void
+init_regbuf(regbuf *b)
+{ b->base = NULL;
+  b->size = 0;
+  b->allocated = 0;
+}
 
-    rval = RegEnumValue(k, i, name, &sizen, NULL, NULL, NULL, NULL);
-    if ( rval == ERROR_SUCCESS )
-    { if ( PL_unify_list(tail, head, tail) &&
-	   PL_unify_atom_chars(head, name) )
-	continue;
-    } else if ( rval == ERROR_NO_MORE_ITEMS )
-    { return PL_unify_nil(tail);
-    } else
-      return api_exception(rval, "names", h);
-  }
+static void
+free_regbuf(regbuf *b)
+{ if ( b->base )
+    free(b->base);
+  init_regbuf(b);
 }
 
+static int
+grow_regbuf(regbuf *b, size_t size)
+{ if ( size > b->allocated )
+  { size_t newsize = b->allocated ? b->allocated : 256;
+    BYTE *n;
+
+    while(newsize < size)
+      newsize *= 2;
+    if ( !(n = realloc(b->base, newsize)) )
+      return FALSE;
+    b->base = n;
+    b->allocated = newsize;
+  }
 
-foreign_t
-pl_reg_value(term_t h, term_t name, term_t value)
-{ HKEY k;
-  char *vname;
-  DWORD rval;
-  BYTE databuf[1024];
-  LPBYTE data = databuf;
-  DWORD sizedata = sizeof(databuf);
-  DWORD type;
+  return TRUE;
+}
 
-  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
-    PL_fail;
+static int
+add_regbuf(regbuf *b, const void *data, size_t len)
+{ if ( !grow_regbuf(b, b->size+len) )
+    return FALSE;
+  memcpy(b->base+b->size, data, len);
+  b->size += len;
 
-  rval = RegQueryValueEx(k, vname, NULL, &type, data, &sizedata);
-  if ( rval == ERROR_MORE_DATA )
-  { data = alloca(sizedata);
-    rval = RegQueryValueEx(k, vname, NULL, &type, data, &sizedata);
-  }
+  return TRUE;
+}
 
-  if ( rval == ERROR_SUCCESS )
-  { switch(type)
-    { case REG_BINARY:
-      { term_t head = PL_new_term_ref();
-	term_t tail = PL_new_term_ref();
-
-	if ( PL_unify_term(value, PL_FUNCTOR, FUNCTOR_binary1,
-					PL_TERM, tail) )
-	{ DWORD i;
-
-	  for(i=0; i<sizedata; i++)
-	  { if ( !PL_unify_list(tail, head, tail) ||
-		 !PL_unify_integer(head, data[i]) )
-	      PL_fail;
-	  }
 
-	  return PL_unify_nil(tail);
-	}
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Read the data of a value into b. The value   may grow between asking for
+its size and reading it, so we retry until the buffer is large enough.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-	PL_fail;
-      }
-      { DWORD v;
-      case REG_DWORD_BIG_ENDIAN:
-      { DWORD v0 = *((DWORD *)data);
-
-	v = ((v0 >>  0) % 0xff) << 24 |
-	    ((v0 >>  8) % 0xff) << 16 |
-	    ((v0 >> 16) % 0xff) <<  8 |
-	    ((v0 >> 24) % 0xff) <<  0;
-	goto case_dword;
-      }
-/*    case REG_DWORD: */
-      case REG_DWORD_LITTLE_ENDIAN:
-	v = *((DWORD *)data);
-      case_dword:
-	return PL_unify_integer(value, v);
-      }
-/*    case REG_QWORD: */
-      case REG_QWORD_LITTLE_ENDIAN:
-      { DWORD64 v = *((DWORD64 *)data);
-	return PL_unify_integer(value, v);
-      }
-      case REG_EXPAND_SZ:
-      { return PL_unify_term(value, PL_FUNCTOR, FUNCTOR_expand1,
-					PL_CHARS, (char *)data);
-      }
-      case REG_LINK:
-      { return PL_unify_term(value, PL_FUNCTOR, FUNCTOR_link1,
-					PL_CHARS, (char *)data);
-      }
-      case REG_MULTI_SZ:
-      { term_t tail = PL_copy_term_ref(value);
-	term_t head = PL_new_term_ref();
-	char *s = (char *)data;
+static DWORD
+query_value(HKEY k, const char *vname, DWORD *type, regbuf *b)
+{ DWORD rval;
 
-	while(*s)
-	{ if ( !PL_unify_list(tail, head, tail) ||
-	       !PL_unify_atom_chars(head, s) )
-	    PL_fail;
+  if ( !grow_regbuf(b, 256) )
+    return ERROR_NOT_ENOUGH_MEMORY;
 
-	  s += strlen(s) + 1;
-	}
+  for(;;)
+  { DWORD size = (DWORD)b->allocated;
 
-	return PL_unify_nil(tail);
-      }
-      case REG_NONE:
-	return PL_unify_atom_chars(value, "<none>");
-      case REG_RESOURCE_LIST:
-	return PL_unify_atom_chars(value, "<resource_list>");
-      case REG_SZ:
-	return PL_unify_atom_chars(value, (char *)data);
+    rval = RegQueryValueEx(k, vname, NULL, type, b->base, &size);
+    if ( rval == ERROR_MORE_DATA )
+    { if ( !grow_regbuf(b, size) )
+	return ERROR_NOT_ENOUGH_MEMORY;
+      continue;
+    }
+    if ( rval == ERROR_SUCCESS )
+    { if ( !grow_regbuf(b, (size_t)size+2) )
+	return ERROR_NOT_ENOUGH_MEMORY;
+      b->base[size] = 0;		/* make sure strings are */
+      b->base[size+1] = 0;		/* terminated */
+      b->size = size;
     }
-  } else
-    return api_exception(rval, "write", h);
 
-  assert(0);
-  return FALSE;
+    return rval;
+  }
 }
 
 
-foreign_t
-pl_reg_set_value(term_t h, term_t name, term_t value)
-{ HKEY k;
-  char *vname;
-  DWORD rval, type;
-  int64_t intval;
-  size_t len;
-  BYTE *data;
+		 /*******************************
+		 *	  BINARY LAYOUTS	*
+		 *******************************/
 
-  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
-    PL_fail;
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Many applications store packed C structures in REG_BINARY values. Rather
+than decoding the binary(Bytes) list in Prolog,   a  layout describes the
+structure and is compiled into a flat array of instructions that is used
+to decode the data into a term or encode a term into data. A layout is
+one of
+
+  - u8, i8, u16le, u16be, i16le, i16be, u32le, u32be, i32le, i32be,
+    u64le, u64be, i64le, i64be
+    An integer of the given size, signedness and byte order.
+  - utf16z
+    A 0-terminated UTF-16 (little endian) string, represented as an atom.
+  - bytes(N)
+    N bytes, represented as a list of integers.
+  - skip(N)
+    N padding bytes.  Skipped when decoding, written as 0 when encoding
+    and not represented in the term.
+  - array(N, Layout)
+    A list of N elements.
+  - repeat(Layout)
+    A list of elements that extends to the end of the data.
+  - [Layout, ...]
+    A structure, represented as a list holding the value of each field.
+  - Name
+    A layout defined using reg_define_layout/2.
+
+Defined layouts are kept in a  table   and  reference counted, such that
+redefining a layout does not affect a concurrent decode. The names of
+the built-in layouts cannot be redefined. Layouts that are passed inline
+are kept in a small round-robin cache,   keyed by the external record of
+the term, so repeated calls with the same layout compile it only once.
+As a compiled layout includes  the   instructions  of the named layouts
+it uses, the cache is flushed when a layout is (re)defined.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
 
-  switch(PL_term_type(value))
-  { case PL_ATOM:
-    { if ( !PL_get_atom_chars(value, (char**)&data) )
-        goto instantiation_error;
-      len = strlen((char*)data) + 1;
-      type = REG_SZ;
-      break;
-    }
-    case PL_STRING:
-    { size_t l;
-      if ( !PL_get_string(value, (char**)&data, &l) )
-        goto instantiation_error;
-      len = l;
-      type = REG_SZ;
-      break;
-    }
-    case PL_INTEGER:
-    { if ( !PL_get_int64(value, &intval) )
-        goto instantiation_error;
-      data = (BYTE *) &intval;
-      if ( intval > INT_MAX || intval < INT_MIN )
-      { len = sizeof(DWORD64);
-        type = REG_QWORD;
-      }
-      else
-      { len = sizeof(DWORD);
-        type = REG_DWORD;
-      }
-      break;
-    }
-    case PL_TERM:
-    { if ( PL_is_functor(value, FUNCTOR_link1) )
-      { type = REG_LINK;
-	goto argdata;
-      } else if ( PL_is_functor(value, FUNCTOR_expand1) )
-      { term_t a;
+typedef enum lcode
+{ L_UINT,				/* unsigned integer */
+  L_INT,				/* signed integer */
+  L_UTF16Z,				/* 0-terminated UTF-16 string */
+  L_BYTES,				/* bytes(N) */
+  L_SKIP,				/* skip(N) */
+  L_ARRAY,				/* array(N, Layout) */
+  L_REPEAT,				/* repeat(Layout) */
+  L_STRUCT				/* [Layout, ...] */
+} lcode;
+
+typedef struct lop
+{ lcode	 code;				/* L_* */
+  int	 width;				/* width of integers */
+  int	 big_endian;			/* byte order of integers */
+  size_t count;				/* bytes, skip, array, #fields */
+  size_t size;				/* #ops of subtree, including self */
+} lop;
+
+typedef struct layout
+{ atom_t	 name;			/* name of defined layout */
+  struct layout *next;			/* next in table */
+  LONG		 references;		/* reference count */
+  size_t	 nops;			/* # instructions */
+  lop		*ops;			/* the instructions */
+} layout;
+
+static const struct int_type
+{ const char *name;
+  lcode code;
+  int width;
+  int big_endian;
+} int_types[] =
+{ { "u8",    L_UINT, 1, FALSE },
+  { "i8",    L_INT,  1, FALSE },
+  { "u16le", L_UINT, 2, FALSE },
+  { "u16be", L_UINT, 2, TRUE  },
+  { "i16le", L_INT,  2, FALSE },
+  { "i16be", L_INT,  2, TRUE  },
+  { "u32le", L_UINT, 4, FALSE },
+  { "u32be", L_UINT, 4, TRUE  },
+  { "i32le", L_INT,  4, FALSE },
+  { "i32be", L_INT,  4, TRUE  },
+  { "u64le", L_UINT, 8, FALSE },
+  { "u64be", L_UINT, 8, TRUE  },
+  { "i64le", L_INT,  8, FALSE },
+  { "i64be", L_INT,  8, TRUE  },
+  { NULL,    L_UINT, 0, FALSE }
+};
+
+#define LAYOUT_CACHE_SIZE 16
+
+typedef struct layout_cache_entry
+{ char	       *key;			/* PL_record_external() of spec */
+  size_t	len;			/* length of key */
+  struct layout *layout;		/* compiled layout */
+} layout_cache_entry;
+
+static layout *layouts = NULL;		/* defined layouts */
+static layout_cache_entry layout_cache[LAYOUT_CACHE_SIZE];
+static int layout_cache_next = 0;
+static LONG layout_generation = 0;	/* incremented on each definition */
+static CRITICAL_SECTION layout_lock;	/* guards layouts and layout_cache */
 
-	type = REG_EXPAND_SZ;
+static void
+release_layout(layout *l)
+{ if ( InterlockedDecrement(&l->references) == 0 )
+  { if ( l->name )
+      PL_unregister_atom(l->name);
+    free(l->ops);
+    free(l);
+  }
+}
 
-      argdata:
-	a = PL_new_term_ref();
-	if ( !(PL_get_arg(1, value, a) &&
-               PL_get_atom_chars(a, (char**)&data)) )
-	  goto instantiation_error;
-	len = strlen((char*)data) + 1;
-	break;
-      }	else {				/* TBD: MULTI_SZ (list) */
-        goto domain_error;
-      }
-    }
-    case PL_VARIABLE:
-    instantiation_error:
-    { return PL_instantiation_error(value);
-    }
-    default:
-    domain_error:
-    { return PL_domain_error("registry_value", value);
-    }
+static int
+builtin_layout(const char *s)
+{ const struct int_type *it;
+
+  for(it=int_types; it->name; it++)
+  { if ( strcmp(it->name, s) == 0 )
+      return TRUE;
   }
 
-  rval = RegSetValueEx(k, vname, 0L, type, data, (DWORD)len);
-  if ( rval == ERROR_SUCCESS )
-    PL_succeed;
+  return strcmp(s, "utf16z") == 0;
+}
 
-  return api_exception(rval, "write", h);
+static layout *
+lookup_layout(atom_t name)
+{ layout *l;
+
+  EnterCriticalSection(&layout_lock);
+  for(l=layouts; l; l=l->next)
+  { if ( l->name == name )
+    { InterlockedIncrement(&l->references);
+      break;
+    }
+  }
+  LeaveCriticalSection(&layout_lock);
+
+  return l;
 }
 
+#define LOP(b, i) (((lop*)(b)->base)[i])
 
-foreign_t
-pl_reg_delete_value(term_t h, term_t name)
-{ HKEY k;
-  char *vname;
-  LONG rval;
+static int
+add_lop(regbuf *b, lcode code, int width, int be, size_t count)
+{ lop op;
 
-  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
-    PL_fail;
+  op.code	= code;
+  op.width	= width;
+  op.big_endian	= be;
+  op.count	= count;
+  op.size	= 1;
 
-  if ( (rval = RegDeleteValue(k, vname)) == ERROR_SUCCESS )
-    PL_succeed;
+  return add_regbuf(b, &op, sizeof(op));
+}
 
-  return api_exception(rval, "delete", name);
+static int
+get_layout_count(term_t t, size_t i, term_t arg, size_t *count)
+{ int64_t n;
+
+  _PL_get_arg(i, t, arg);
+  if ( !PL_get_int64(arg, &n) )
+    return PL_type_error("integer", arg);
+  if ( n < 0 )
+    return PL_domain_error("not_less_than_zero", arg);
+  *count = (size_t)n;
+
+  return TRUE;
 }
 
+static int
+compile_layout(term_t spec, regbuf *b)
+{ atom_t name;
+  size_t arity;
+  size_t here = b->size/sizeof(lop);
+  term_t arg = PL_new_term_ref();
+  size_t count;
+
+  if ( PL_get_nil(spec) || PL_is_pair(spec) )
+  { term_t tail = PL_copy_term_ref(spec);
+
+    if ( !add_lop(b, L_STRUCT, 0, FALSE, 0) )
+      return PL_resource_error("memory");
+    count = 0;
+    while(PL_get_list(tail, arg, tail))
+    { if ( !compile_layout(arg, b) )
+	return FALSE;
+      count++;
+    }
+    if ( !PL_get_nil(tail) )
+      return PL_type_error("list", spec);
+    LOP(b, here).count = count;
+  } else if ( PL_get_atom(spec, &name) )
+  { const struct int_type *it;
+    const char *s = PL_atom_chars(name);
+    layout *l;
+
+    for(it=int_types; it->name; it++)
+    { if ( strcmp(it->name, s) == 0 )
+      { if ( !add_lop(b, it->code, it->width, it->big_endian, 0) )
+	  return PL_resource_error("memory");
+	return TRUE;
+      }
+    }
+    if ( strcmp(s, "utf16z") == 0 )
+    { if ( !add_lop(b, L_UTF16Z, 0, FALSE, 0) )
+	return PL_resource_error("memory");
+      return TRUE;
+    }
+    if ( (l=lookup_layout(name)) )
+    { int rc = add_regbuf(b, l->ops, l->nops*sizeof(lop));
 
+      release_layout(l);
+      if ( !rc )
+	return PL_resource_error("memory");
+      return TRUE;
+    }
 
+    return PL_domain_error("registry_layout", spec);
+  } else if ( PL_get_name_arity(spec, &name, &arity) )
+  { const char *s = PL_atom_chars(name);
 
-foreign_t
-pl_reg_flush(term_t h)
-{ HKEY k;
+    if ( arity == 1 && strcmp(s, "bytes") == 0 )
+    { if ( !get_layout_count(spec, 1, arg, &count) )
+	return FALSE;
+      if ( !add_lop(b, L_BYTES, 0, FALSE, count) )
+	return PL_resource_error("memory");
+      return TRUE;
+    } else if ( arity == 1 && strcmp(s, "skip") == 0 )
+    { if ( !get_layout_count(spec, 1, arg, &count) )
+	return FALSE;
+      if ( !add_lop(b, L_SKIP, 0, FALSE, count) )
+	return PL_resource_error("memory");
+      return TRUE;
+    } else if ( arity == 2 && strcmp(s, "array") == 0 )
+    { if ( !get_layout_count(spec, 1, arg, &count) )
+	return FALSE;
+      if ( !add_lop(b, L_ARRAY, 0, FALSE, count) )
+	return PL_resource_error("memory");
+      _PL_get_arg(2, spec, arg);
+      if ( !compile_layout(arg, b) )
+	return FALSE;
+    } else if ( arity == 1 && strcmp(s, "repeat") == 0 )
+    { if ( !add_lop(b, L_REPEAT, 0, FALSE, 0) )
+	return PL_resource_error("memory");
+      _PL_get_arg(1, spec, arg);
+      if ( !compile_layout(arg, b) )
+	return FALSE;
+    } else
+      return PL_domain_error("registry_layout", spec);
+  } else
+    return PL_type_error("registry_layout", spec);
 
-  if ( (k = to_key(h)) )
-  { DWORD rval;
+  LOP(b, here).size = b->size/sizeof(lop) - here;
+  return TRUE;
+}
 
-    if ( (rval = RegFlushKey(k)) == ERROR_SUCCESS )
-      PL_succeed;
 
-    return api_exception(rval, "flush", h);
+static layout *
+new_layout(term_t spec)
+{ regbuf b;
+  layout *l;
+
+  init_regbuf(&b);
+  if ( !compile_layout(spec, &b) )
+  { free_regbuf(&b);
+    return NULL;
+  }
+  if ( !(l = malloc(sizeof(*l))) )
+  { free_regbuf(&b);
+    PL_resource_error("memory");
+    return NULL;
   }
+  l->name	= 0;
+  l->next	= NULL;
+  l->references = 1;
+  l->nops	= b.size/sizeof(lop);
+  l->ops	= (lop*)b.base;
 
-  PL_fail;
+  return l;
 }
 
 
-foreign_t
+static layout *
+cached_layout(term_t spec)
+{ char *key, *oldkey;
+  size_t len;
+  layout *l = NULL, *old;
+  layout_cache_entry *e;
+  LONG generation;
+  int i;
+
+  if ( !(key = PL_record_external(spec, &len)) )
+    return new_layout(spec);
+
+  EnterCriticalSection(&layout_lock);
+  generation = layout_generation;
+  for(i=0; i<LAYOUT_CACHE_SIZE; i++)
+  { e = &layout_cache[i];
+    if ( e->layout && e->len == len && memcmp(e->key, key, len) == 0 )
+    { l = e->layout;
+      InterlockedIncrement(&l->references);
+      break;
+    }
+  }
+  LeaveCriticalSection(&layout_lock);
+
+  if ( l || !(l = new_layout(spec)) )
+  { PL_erase_external(key);
+    return l;
+  }
+
+  EnterCriticalSection(&layout_lock);
+  if ( generation != layout_generation ) /* compiled against old layouts */
+  { LeaveCriticalSection(&layout_lock);
+    PL_erase_external(key);
+    return l;
+  }
+  InterlockedIncrement(&l->references);	/* reference of the cache */
+  e = &layout_cache[layout_cache_next];
+  layout_cache_next = (layout_cache_next+1) % LAYOUT_CACHE_SIZE;
+  old = e->layout;
+  oldkey = e->key;
+  e->key = key;
+  e->len = len;
+  e->layout = l;
+  LeaveCriticalSection(&layout_lock);
+
+  if ( old )
+  { PL_erase_external(oldkey);
+    release_layout(old);
+  }
+
+  return l;
+}
+
+static void
+flush_layout_cache(void)
+{ layout_cache_entry old[LAYOUT_CACHE_SIZE];
+  int i;
+
+  EnterCriticalSection(&layout_lock);
+  layout_generation++;
+  memcpy(old, layout_cache, sizeof(old));
+  memset(layout_cache, 0, sizeof(layout_cache));
+  LeaveCriticalSection(&layout_lock);
+
+  for(i=0; i<LAYOUT_CACHE_SIZE; i++)
+  { if ( old[i].layout )
+    { PL_erase_external(old[i].key);
+      release_layout(old[i].layout);
+    }
+  }
+}
+
+/* get_layout() returns a layout with an additional reference.  The
+   caller must call release_layout() when done.
+*/
+
+static layout *
+get_layout(term_t spec)
+{ atom_t name;
+  layout *l;
+
+  if ( PL_get_atom(spec, &name) && (l=lookup_layout(name)) )
+    return l;
+
+  return cached_layout(spec);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_define_layout(+Name, +Layout)
+	Compile Layout and store it under Name.  Name can subsequently be
+	used as layout for reg_decode/4, layout(Name, Term) values for
+	reg_set_value/3 and inside other layouts.  Raises a permission
+	error if Name is a built-in layout such as u32le or utf16z.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+foreign_t
+pl_reg_define_layout(term_t name, term_t spec)
+{ atom_t a;
+  layout *l, **lp;
+
+  if ( !PL_get_atom(name, &a) )
+    return PL_type_error("atom", name);
+  if ( builtin_layout(PL_atom_chars(a)) )
+    return PL_permission_error("modify", "registry_layout", name);
+  if ( !(l = new_layout(spec)) )
+    PL_fail;
+  l->name = a;
+  PL_register_atom(a);
+
+  EnterCriticalSection(&layout_lock);
+  for(lp=&layouts; *lp; lp=&(*lp)->next)
+  { if ( (*lp)->name == a )
+    { layout *old = *lp;
+
+      l->next = old->next;
+      *lp = l;
+      LeaveCriticalSection(&layout_lock);
+      release_layout(old);
+      flush_layout_cache();
+      PL_succeed;
+    }
+  }
+  l->next = layouts;
+  layouts = l;
+  LeaveCriticalSection(&layout_lock);
+  flush_layout_cache();
+
+  PL_succeed;
+}
+
+
+static uint64_t
+get_uint(const BYTE *p, int width, int big_endian)
+{ uint64_t v = 0;
+  int i;
+
+  if ( big_endian )
+  { for(i=0; i<width; i++)
+      v = (v<<8)|p[i];
+  } else
+  { for(i=width; --i >= 0; )
+      v = (v<<8)|p[i];
+  }
+
+  return v;
+}
+
+static void
+put_uint(BYTE *p, uint64_t v, int width, int big_endian)
+{ int i;
+
+  if ( big_endian )
+  { for(i=width; --i >= 0; v >>= 8)
+      p[i] = (BYTE)(v&0xff);
+  } else
+  { for(i=0; i<width; i++, v >>= 8)
+      p[i] = (BYTE)(v&0xff);
+  }
+}
+
+
+/* decode_op() decodes the data at *pp according to op into t.  It
+   returns the next instruction or NULL if the data does not match
+   the layout or an error was raised.
+*/
+
+static const lop *
+decode_op(const lop *op, const BYTE **pp, const BYTE *e, term_t t)
+{ const BYTE *p = *pp;
+
+  switch(op->code)
+  { case L_UINT:
+    case L_INT:
+    { uint64_t v;
+
+      if ( (size_t)(e-p) < (size_t)op->width )
+	return NULL;
+      v = get_uint(p, op->width, op->big_endian);
+      *pp = p+op->width;
+      if ( op->code == L_INT )
+      { int shift = 64-op->width*8;
+	int64_t i = (int64_t)(v<<shift)>>shift;
+
+	if ( !PL_unify_int64(t, i) )
+	  return NULL;
+      } else if ( !PL_unify_uint64(t, v) )
+	return NULL;
+      break;
+    }
+    case L_UTF16Z:
+    { const BYTE *s;
+      size_t len, i;
+      pl_wchar_t *ws;
+      int rc;
+
+      for(s=p; e-s >= 2; s += 2)
+      { if ( s[0] == 0 && s[1] == 0 )
+	  break;
+      }
+      if ( e-s < 2 )
+	return NULL;
+      len = (s-p)/2;
+      if ( !(ws = malloc((len+1)*sizeof(pl_wchar_t))) )
+      { PL_resource_error("memory");
+	return NULL;
+      }
+      for(i=0; i<len; i++)
+	ws[i] = (pl_wchar_t)get_uint(p+i*2, 2, FALSE);
+      rc = PL_unify_wchars(t, PL_ATOM, len, ws);
+      free(ws);
+      if ( !rc )
+	return NULL;
+      *pp = s+2;
+      break;
+    }
+    case L_BYTES:
+    { term_t tail = PL_copy_term_ref(t);
+      term_t head = PL_new_term_ref();
+      size_t i;
+
+      if ( (size_t)(e-p) < op->count )
+	return NULL;
+      for(i=0; i<op->count; i++)
+      { if ( !PL_unify_list(tail, head, tail) ||
+	     !PL_unify_integer(head, p[i]) )
+	  return NULL;
+      }
+      if ( !PL_unify_nil(tail) )
+	return NULL;
+      *pp = p+op->count;
+      break;
+    }
+    case L_SKIP:
+    { if ( (size_t)(e-p) < op->count )
+	return NULL;
+      *pp = p+op->count;
+      break;
+    }
+    case L_ARRAY:
+    case L_REPEAT:
+    { term_t tail = PL_copy_term_ref(t);
+      term_t head = PL_new_term_ref();
+      size_t i;
+
+      for(i=0; op->code == L_REPEAT ? *pp < e : i < op->count; i++)
+      { const BYTE *start = *pp;
+
+	if ( !PL_unify_list(tail, head, tail) ||
+	     !decode_op(op+1, pp, e, head) )
+	  return NULL;
+	if ( op->code == L_REPEAT && *pp == start )
+	  return NULL;			/* empty element */
+      }
+      if ( !PL_unify_nil(tail) )
+	return NULL;
+      break;
+    }
+    case L_STRUCT:
+    { term_t tail = PL_copy_term_ref(t);
+      term_t head = PL_new_term_ref();
+      const lop *f = op+1;
+      size_t i;
+
+      for(i=0; i<op->count; i++)
+      { if ( f->code == L_SKIP )
+	{ if ( !(f=decode_op(f, pp, e, 0)) )
+	    return NULL;
+	} else
+	{ if ( !PL_unify_list(tail, head, tail) ||
+	       !(f=decode_op(f, pp, e, head)) )
+	    return NULL;
+	}
+      }
+      if ( !PL_unify_nil(tail) )
+	return NULL;
+      break;
+    }
+  }
+
+  return op+op->size;
+}
+
+
+static int
+encode_int(const lop *op, term_t t, regbuf *b)
+{ BYTE buf[8];
+  uint64_t v;
+
+  if ( op->code == L_UINT )
+  { if ( !PL_get_uint64(t, &v) )
+      return PL_type_error("nonneg", t);
+    if ( op->width < 8 && v >> (op->width*8) )
+      return PL_representation_error("registry_layout_integer");
+  } else
+  { int64_t i;
+
+    if ( !PL_get_int64(t, &i) )
+      return PL_type_error("integer", t);
+    if ( op->width < 8 )
+    { int64_t max = ((int64_t)1 << (op->width*8-1));
+
+      if ( i >= max || i < -max )
+	return PL_representation_error("registry_layout_integer");
+    }
+    v = (uint64_t)i;
+  }
+
+  put_uint(buf, v, op->width, op->big_endian);
+  if ( !add_regbuf(b, buf, op->width) )
+    return PL_resource_error("memory");
+
+  return TRUE;
+}
+
+
+static int
+encode_utf16(term_t t, regbuf *b)
+{ pl_wchar_t *ws;
+  size_t len, i;
+  BYTE buf[4];
+
+  if ( !PL_get_wchars(t, &len, &ws, CVT_ATOM|CVT_STRING|CVT_EXCEPTION) )
+    return FALSE;
+  for(i=0; i<len; i++)
+  { unsigned int c = (unsigned int)ws[i];
+
+    if ( c == 0 )
+      return PL_domain_error("utf16z", t);
+    if ( c > 0xffff )
+    { c -= 0x10000;
+      put_uint(buf,   0xd800+(c>>10),   2, FALSE);
+      put_uint(buf+2, 0xdc00+(c&0x3ff), 2, FALSE);
+      if ( !add_regbuf(b, buf, 4) )
+	return PL_resource_error("memory");
+    } else
+    { put_uint(buf, c, 2, FALSE);
+      if ( !add_regbuf(b, buf, 2) )
+	return PL_resource_error("memory");
+    }
+  }
+
+  put_uint(buf, 0, 2, FALSE);
+  if ( !add_regbuf(b, buf, 2) )
+    return PL_resource_error("memory");
+
+  return TRUE;
+}
+
+
+/* encode_op() is the inverse of decode_op().  It returns the next
+   instruction or NULL after raising an exception.
+*/
+
+static const lop *
+encode_op(const lop *op, term_t t, regbuf *b)
+{ switch(op->code)
+  { case L_UINT:
+    case L_INT:
+      if ( !encode_int(op, t, b) )
+	return NULL;
+      break;
+    case L_UTF16Z:
+      if ( !encode_utf16(t, b) )
+	return NULL;
+      break;
+    case L_SKIP:
+    { size_t i;
+
+      for(i=0; i<op->count; i++)
+      { if ( !add_regbuf(b, "", 1) )
+	{ PL_resource_error("memory");
+	  return NULL;
+	}
+      }
+      break;
+    }
+    case L_BYTES:
+    case L_ARRAY:
+    case L_REPEAT:
+    case L_STRUCT:
+    { term_t tail = PL_copy_term_ref(t);
+      term_t head = PL_new_term_ref();
+      const lop *f = op+1;
+      size_t i;
+
+      for(i=0; op->code == L_REPEAT || i < op->count; i++)
+      { if ( op->code == L_STRUCT && f->code == L_SKIP )
+	{ if ( !(f=encode_op(f, 0, b)) )
+	    return NULL;
+	  continue;
+	}
+	if ( !PL_get_list(tail, head, tail) )
+	{ if ( op->code == L_REPEAT )
+	    break;
+	  PL_domain_error("registry_layout_list", t);
+	  return NULL;
+	}
+	switch(op->code)
+	{ case L_BYTES:
+	  { int c;
+	    BYTE byte;
+
+	    if ( !PL_get_integer(head, &c) || c < 0 || c > 255 )
+	    { PL_type_error("byte", head);
+	      return NULL;
+	    }
+	    byte = (BYTE)c;
+	    if ( !add_regbuf(b, &byte, 1) )
+	    { PL_resource_error("memory");
+	      return NULL;
+	    }
+	    break;
+	  }
+	  case L_STRUCT:
+	    if ( !(f=encode_op(f, head, b)) )
+	      return NULL;
+	    break;
+	  default:
+	    if ( !encode_op(op+1, head, b) )
+	      return NULL;
+	}
+      }
+      if ( !PL_get_nil(tail) )
+      { PL_domain_error("registry_layout_list", t);
+	return NULL;
+      }
+      break;
+    }
+  }
+
+  return op+op->size;
+}
+
+
+static int
+encode_layout(term_t spec, term_t t, regbuf *b)
+{ layout *l;
+  int rc;
+
+  if ( !(l = get_layout(spec)) )
+    return FALSE;
+  rc = (encode_op(l->ops, t, b) != NULL);
+  release_layout(l);
+
+  return rc;
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_decode(+Key, +Name, +Layout, -Term)
+	Decode the data of the value Name according to Layout.  Fails if
+	the data does not match the layout.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+foreign_t
+pl_reg_decode(term_t h, term_t name, term_t spec, term_t term)
+{ HKEY k;
+  char *vname;
+  DWORD rval, type;
+  regbuf b;
+  layout *l;
+  int rc = FALSE;
+
+  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
+    PL_fail;
+  if ( !(l = get_layout(spec)) )
+    PL_fail;
+
+  init_regbuf(&b);
+  if ( (rval = query_value(k, vname, &type, &b)) == ERROR_SUCCESS )
+  { const BYTE *p = b.base;
+    const BYTE *e = p+b.size;
+
+    TRACE_DATA(type, b.size);
+    rc = ( decode_op(l->ops, &p, e, term) && p == e );
+  } else if ( rval != ERROR_FILE_NOT_FOUND )
+    rc = api_exception(rval, "read", h);
+  free_regbuf(&b);
+  release_layout(l);
+
+  return rc;
+}
+
+
+		 /*******************************
+		 *	   MULTI STRINGS	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+REG_MULTI_SZ values are sequences of 0-terminated strings, terminated by
+an empty string. Some of these hold thousands  of elements, so we locate
+all terminators in a single pass, using SSE2   to  test 16 bytes at once
+where available, and then build the list from the end using PL_cons_list()
+rather than unifying cell by cell.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+static int
+ctz32(unsigned int m)
+{ unsigned long i;
+
+  _BitScanForward(&i, m);
+  return (int)i;
+}
+#else
+#define ctz32(m) __builtin_ctz(m)
+#endif
+#endif
+
+/* Add the offset of each 0-byte in data to ends.  Returns FALSE if we
+   run out of memory.
+*/
+
+static int
+scan_terminators(const BYTE *data, size_t size, regbuf *ends)
+{ size_t i = 0;
+
+#ifdef HAVE_SSE2
+  const __m128i zero = _mm_setzero_si128();
+
+  for(; i+16 <= size; i += 16)
+  { __m128i chunk = _mm_loadu_si128((const __m128i*)(data+i));
+    unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero));
+
+    while(mask)
+    { size_t at = i+ctz32(mask);
+
+      if ( !add_regbuf(ends, &at, sizeof(at)) )
+	return FALSE;
+      mask &= mask-1;
+    }
+  }
+#endif
+
+  for(; i<size; i++)
+  { if ( data[i] == 0 && !add_regbuf(ends, &i, sizeof(i)) )
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+
+static int
+unify_multi_sz(term_t value, const BYTE *data, size_t size,
+	       const reg_options *opts)
+{ regbuf b;
+  const size_t *ends;
+  size_t n, count, start = 0;
+  term_t list, el;
+  int rc = TRUE;
+
+  init_regbuf(&b);
+  if ( !scan_terminators(data, size, &b) )
+  { free_regbuf(&b);
+    return PL_resource_error("memory");
+  }
+  ends = (const size_t*)b.base;
+  count = b.size/sizeof(size_t);
+
+  for(n=0; n<count; n++)		/* find the empty string */
+  { if ( ends[n] == start )
+      break;
+    start = ends[n]+1;
+  }
+  if ( n == count && start < size )	/* unterminated last element */
+  { if ( !add_regbuf(&b, &size, sizeof(size)) )
+    { free_regbuf(&b);
+      return PL_resource_error("memory");
+    }
+    ends = (const size_t*)b.base;
+    n++;
+  }
+
+  list = PL_new_term_ref();
+  el   = PL_new_term_ref();
+  PL_put_nil(list);
+  while(rc && n-- > 0)
+  { size_t from = (n == 0 ? 0 : ends[n-1]+1);
+
+    rc = ( PL_put_chars(el, opts->text_type, ends[n]-from,
+			(const char*)data+from) &&
+	   PL_cons_list(list, el, list) );
+  }
+  free_regbuf(&b);
+
+  return rc && PL_unify(value, list);
+}
+
+
+/* Collect a list of text into b as REG_MULTI_SZ data.  The buffer is
+   sized in a first pass over the list.
+*/
+
+static int
+get_multi_sz(term_t value, regbuf *b)
+{ term_t tail = PL_copy_term_ref(value);
+  term_t head = PL_new_term_ref();
+  size_t total = 1;
+  size_t len;
+  char *s;
+
+  while(PL_get_list(tail, head, tail))
+  { if ( !PL_get_nchars(head, &len, &s, CVT_ATOM|CVT_STRING|CVT_EXCEPTION) )
+      return FALSE;
+    if ( len == 0 || memchr(s, 0, len) )
+      return PL_domain_error("multi_sz_element", head);
+    total += len+1;
+  }
+  if ( !PL_get_nil(tail) )
+    return PL_type_error("list", value);
+
+  if ( !grow_regbuf(b, total) )
+    return PL_resource_error("memory");
+  tail = PL_copy_term_ref(value);
+  while(PL_get_list(tail, head, tail))
+  { PL_get_nchars(head, &len, &s, CVT_ATOM|CVT_STRING);
+    memcpy(b->base+b->size, s, len+1);
+    b->size += len+1;
+  }
+  b->base[b->size++] = 0;
+
+  return TRUE;
+}
+
+
+		 /*******************************
+		 *	       VALUE		*
+		 *******************************/
+
+static foreign_t
+reg_value_names(term_t h, term_t names, const reg_options *opts)
+{ HKEY k;
+  DWORD rval;
+  term_t tail = PL_copy_term_ref(names);
+  term_t head = PL_new_term_ref();
+  DWORD i;
+
+  if ( !(k = to_key(h)) )
+    PL_fail;
+
+  for(i=0;;i++)
+  { char name[256];
+    DWORD sizen = sizeof(name);
+
+    rval = RegEnumValue(k, i, name, &sizen, NULL, NULL, NULL, NULL);
+    if ( rval == ERROR_SUCCESS )
+    { if ( PL_unify_list(tail, head, tail) &&
+	   unify_text(head, name, opts) )
+	continue;
+      PL_fail;
+    } else if ( rval == ERROR_NO_MORE_ITEMS )
+    { return PL_unify_nil(tail);
+    } else
+      return api_exception(rval, "names", h);
+  }
+}
+
+
+foreign_t
+pl_reg_value_names(term_t h, term_t names)
+{ return reg_value_names(h, names, &default_options);
+}
+
+
+foreign_t
+pl_reg_value_names3(term_t h, term_t names, term_t options)
+{ reg_options opts;
+
+  if ( !get_reg_options(options, &opts) )
+    PL_fail;
+
+  return reg_value_names(h, names, &opts);
+}
+
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Translate value data of the given type into a Prolog term.  Types we
+do not know are returned as binary(Bytes).
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static int
+unify_value(term_t value, DWORD type, const BYTE *data, DWORD sizedata,
+	    const reg_options *opts)
+{ switch(type)
+  { default:
+    case REG_BINARY:
+    { term_t head = PL_new_term_ref();
+      term_t tail = PL_new_term_ref();
+
+      if ( PL_unify_term(value, PL_FUNCTOR, FUNCTOR_binary1,
+				      PL_TERM, tail) )
+      { DWORD i;
+
+	for(i=0; i<sizedata; i++)
+	{ if ( !PL_unify_list(tail, head, tail) ||
+	       !PL_unify_integer(head, data[i]) )
+	    PL_fail;
+	}
+
+	return PL_unify_nil(tail);
+      }
+
+      PL_fail;
+    }
+    { DWORD v;
+    case REG_DWORD_BIG_ENDIAN:
+    { DWORD v0 = *((const DWORD *)data);
+
+      v = ((v0 >>  0) % 0xff) << 24 |
+	  ((v0 >>  8) % 0xff) << 16 |
+	  ((v0 >> 16) % 0xff) <<  8 |
+	  ((v0 >> 24) % 0xff) <<  0;
+      goto case_dword;
+    }
+/*  case REG_DWORD: */
+    case REG_DWORD_LITTLE_ENDIAN:
+      v = *((const DWORD *)data);
+    case_dword:
+      return PL_unify_integer(value, v);
+    }
+/*  case REG_QWORD: */
+    case REG_QWORD_LITTLE_ENDIAN:
+    { DWORD64 v = *((const DWORD64 *)data);
+      return PL_unify_integer(value, v);
+    }
+    case REG_EXPAND_SZ:
+    { term_t a = PL_new_term_ref();
+
+      return ( unify_text(a, (const char *)data, opts) &&
+	       PL_unify_term(value, PL_FUNCTOR, FUNCTOR_expand1,
+				      PL_TERM, a) );
+    }
+    case REG_LINK:
+    { term_t a = PL_new_term_ref();
+
+      return ( unify_text(a, (const char *)data, opts) &&
+	       PL_unify_term(value, PL_FUNCTOR, FUNCTOR_link1,
+				      PL_TERM, a) );
+    }
+    case REG_MULTI_SZ:
+      return unify_multi_sz(value, data, sizedata, opts);
+    case REG_NONE:
+      return PL_unify_atom_chars(value, "<none>");
+    case REG_RESOURCE_LIST:
+      return PL_unify_atom_chars(value, "<resource_list>");
+    case REG_FULL_RESOURCE_DESCRIPTOR:
+      return PL_unify_atom_chars(value, "<full_resource_descriptor>");
+    case REG_RESOURCE_REQUIREMENTS_LIST:
+      return PL_unify_atom_chars(value, "<resource_requirements_list>");
+    case REG_SZ:
+      return unify_text(value, (const char *)data, opts);
+  }
+}
+
+
+static foreign_t
+reg_value(term_t h, term_t name, term_t value, const reg_options *opts)
+{ HKEY k;
+  char *vname;
+  DWORD rval;
+  BYTE databuf[1024];
+  LPBYTE data = databuf;
+  DWORD sizedata = sizeof(databuf);
+  DWORD type;
+
+  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
+    PL_fail;
+
+  rval = RegQueryValueEx(k, vname, NULL, &type, data, &sizedata);
+  if ( rval == ERROR_MORE_DATA )
+  { data = alloca(sizedata);
+    rval = RegQueryValueEx(k, vname, NULL, &type, data, &sizedata);
+  }
+
+  if ( rval == ERROR_SUCCESS )
+  { TRACE_DATA(type, sizedata);
+    return unify_value(value, type, data, sizedata, opts);
+  }
+
+  return api_exception(rval, "write", h);
+}
+
+
+foreign_t
+pl_reg_value(term_t h, term_t name, term_t value)
+{ return reg_value(h, name, value, &default_options);
+}
+
+
+foreign_t
+pl_reg_value4(term_t h, term_t name, term_t value, term_t options)
+{ reg_options opts;
+
+  if ( !get_reg_options(options, &opts) )
+    PL_fail;
+
+  return reg_value(h, name, value, &opts);
+}
+
+
+foreign_t
+pl_reg_set_value(term_t h, term_t name, term_t value)
+{ HKEY k;
+  char *vname;
+  DWORD rval, type;
+  int64_t intval;
+  size_t len;
+  BYTE *data;
+  regbuf buf;
+
+  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
+    PL_fail;
+
+  init_regbuf(&buf);
+  switch(PL_term_type(value))
+  { case PL_ATOM:
+    { if ( !PL_get_atom_chars(value, (char**)&data) )
+        goto instantiation_error;
+      len = strlen((char*)data) + 1;
+      type = REG_SZ;
+      break;
+    }
+    case PL_STRING:
+    { size_t l;
+      if ( !PL_get_string(value, (char**)&data, &l) )
+        goto instantiation_error;
+      len = l;
+      type = REG_SZ;
+      break;
+    }
+    case PL_INTEGER:
+    { if ( !PL_get_int64(value, &intval) )
+        goto instantiation_error;
+      data = (BYTE *) &intval;
+      if ( intval > INT_MAX || intval < INT_MIN )
+      { len = sizeof(DWORD64);
+        type = REG_QWORD;
+      }
+      else
+      { len = sizeof(DWORD);
+        type = REG_DWORD;
+      }
+      break;
+    }
+    case PL_TERM:
+    { if ( PL_is_functor(value, FUNCTOR_link1) )
+      { type = REG_LINK;
+	goto argdata;
+      } else if ( PL_is_functor(value, FUNCTOR_expand1) )
+      { term_t a;
+
+	type = REG_EXPAND_SZ;
+
+      argdata:
+	a = PL_new_term_ref();
+	if ( !(PL_get_arg(1, value, a) &&
+               PL_get_atom_chars(a, (char**)&data)) )
+	  goto instantiation_error;
+	len = strlen((char*)data) + 1;
+	break;
+      } else if ( PL_is_functor(value, FUNCTOR_layout2) )
+      { term_t spec = PL_new_term_ref();
+	term_t a = PL_new_term_ref();
+
+	_PL_get_arg(1, value, spec);
+	_PL_get_arg(2, value, a);
+	if ( !encode_layout(spec, a, &buf) )
+	{ free_regbuf(&buf);
+	  PL_fail;
+	}
+	data = buf.base;
+	len = buf.size;
+	type = REG_BINARY;
+	break;
+      }	else {
+        goto domain_error;
+      }
+    }
+    case PL_NIL:
+    case PL_LIST_PAIR:
+    { if ( !get_multi_sz(value, &buf) )
+      { free_regbuf(&buf);
+	PL_fail;
+      }
+      data = buf.base;
+      len = buf.size;
+      type = REG_MULTI_SZ;
+      break;
+    }
+    case PL_VARIABLE:
+    instantiation_error:
+    { return PL_instantiation_error(value);
+    }
+    default:
+    domain_error:
+    { return PL_domain_error("registry_value", value);
+    }
+  }
+
+  TRACE_DATA(type, len);
+  rval = RegSetValueEx(k, vname, 0L, type, data, (DWORD)len);
+  free_regbuf(&buf);
+  if ( rval == ERROR_SUCCESS )
+    PL_succeed;
+
+  return api_exception(rval, "write", h);
+}
+
+
+foreign_t
+pl_reg_delete_value(term_t h, term_t name)
+{ HKEY k;
+  char *vname;
+  LONG rval;
+
+  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
+    PL_fail;
+
+  if ( (rval = RegDeleteValue(k, vname)) == ERROR_SUCCESS )
+    PL_succeed;
+
+  return api_exception(rval, "delete", name);
+}
+
+
+
+
+foreign_t
+pl_reg_flush(term_t h)
+{ HKEY k;
+
+  if ( (k = to_key(h)) )
+  { DWORD rval;
+
+    if ( (rval = RegFlushKey(k)) == ERROR_SUCCESS )
+      PL_succeed;
+
+    return api_exception(rval, "flush", h);
+  }
+
+  PL_fail;
+}
+
+
+foreign_t
 pl_reg_create_key(term_t h, term_t name,
 		  term_t class, term_t options, term_t access,
 		  term_t key)
@@ -663,37 +1938,3006 @@ pl_reg_create_key(term_t h, term_t name,
   term_t tail = PL_copy_term_ref(options);
   term_t head = PL_new_term_ref();
   DWORD rval;
-  DWORD disp;
+  DWORD disp;
+
+  if ( !(k = to_key(h)) ||
+       !PL_get_atom_chars(name, &kname) ||
+       !PL_get_atom_chars(class, &cname) ||
+       !get_access(access, &mode) )
+    PL_fail;
+
+  while(PL_get_list(tail, head, tail))
+  { atom_t a;
+
+    if ( PL_get_atom(head, &a) )
+    { if ( a == ATOM_volatile )
+      {	ops &= ~REG_OPTION_NON_VOLATILE;
+	ops |= REG_OPTION_VOLATILE;
+	continue;
+      }
+    }
+
+    PL_fail;
+  }
+  if ( !PL_get_nil(tail) )
+    PL_fail;
+
+  rval = RegCreateKeyEx(k, kname, 0L, cname, ops, mode, NULL, &skey, &disp);
+  if ( rval == ERROR_SUCCESS )
+    return PL_unify_integer(key, (int)(intptr_t)skey);
+  else
+    return api_exception(rval, "create", name);
+}
+
+		 /*******************************
+		 *	       USAGE		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_usage(+Root, +Options, -Stats)
+	Compute the size of the tree below Root.  Stats is a list
+
+	  - keys(Count)
+	  - values(Count)
+	  - bytes(Count)
+	    Total size of the value data.
+	  - max_depth(Depth)
+	    Where the immediate children of the key are at depth 1.
+	  - denied(Count)
+	    Number of keys that could not be opened.
+	  - types(List)
+	    List of Type-Bytes for each value type that appears.
+	  - largest(List)
+	    List of child(Name, Stats) terms for the largest children,
+	    largest first.  Stats is a list in the same format that
+	    describes the subtree below the child.  Omitted for keys
+	    at depth(Depth).
+
+	Options:
+
+	  - threads(+Count)
+	    Number of threads used.  Default is the number of processors.
+	  - top(+Count)
+	    Number of children in each largest(List).  Default is 10.
+	  - depth(+Depth)
+	    Depth to which largest(List) is reported.  Default is 1,
+	    i.e., only the children of Root.
+
+Worker threads do not use Prolog. They take   a key from a shared stack
+of tasks and walk it, adding  the  counts   to  a  private usage record.
+While fewer tasks than threads are  waiting,   a  worker  pushes the
+subkeys it finds as new tasks rather   than walking them itself, so the
+work is split at any depth. Keys up to   depth(Depth)  get a node in the
+result tree and are always pushed.  The   private  counts are added to
+the node of the task under the lock, and the nodes are summed afterwards.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define REG_TYPE_COUNT	  12		/* REG_NONE ... REG_QWORD */
+#define MAX_VALUE_NAME	  16384		/* max value name length + 1 */
+#define MAX_USAGE_THREADS 64
+
+static const char *reg_type_names[REG_TYPE_COUNT+1] =
+{ "none",
+  "sz",
+  "expand_sz",
+  "binary",
+  "dword",
+  "dword_big_endian",
+  "link",
+  "multi_sz",
+  "resource_list",
+  "full_resource_descriptor",
+  "resource_requirements_list",
+  "qword",
+  "other"
+};
+
+typedef struct usage
+{ int64_t keys;				/* # keys, including this one */
+  int64_t values;			/* # values */
+  int64_t bytes;			/* total value data */
+  int64_t denied;			/* # keys we could not open */
+  int64_t type_bytes[REG_TYPE_COUNT+1];	/* data per value type */
+  int	  max_depth;			/* deepest key */
+} usage;
+
+typedef struct usage_node
+{ char	name[256];			/* name of the key */
+  int	depth;				/* depth below Root */
+  usage	usage;				/* usage of the subtree */
+  struct usage_node *children;		/* reported children */
+  struct usage_node *next;		/* next sibling */
+} usage_node;
+
+typedef struct usage_task
+{ HKEY	      key;			/* key to walk */
+  int	      depth;			/* its depth below Root */
+  usage_node *node;			/* node to add the counts to */
+} usage_task;
+
+typedef struct usage_job
+{ HKEY		   root;		/* root of the scan */
+  int		   nthreads;		/* # workers */
+  int		   report_depth;	/* depth(Depth) */
+  CRITICAL_SECTION lock;		/* protects the fields below */
+  CONDITION_VARIABLE changed;		/* tasks or active changed */
+  usage_task	  *tasks;		/* stack of waiting tasks */
+  volatile int	   count;		/* # waiting tasks */
+  int		   allocated;		/* allocated size of tasks */
+  int		   active;		/* # tasks being walked */
+} usage_job;
+
+static int
+reg_type_index(DWORD type)
+{ return type < REG_TYPE_COUNT ? (int)type : REG_TYPE_COUNT;
+}
+
+static void
+count_values(HKEY k, usage *u, char *vname)
+{ DWORD i;
+
+  for(i=0;;i++)
+  { DWORD sizen = MAX_VALUE_NAME;
+    DWORD type, size;
+
+    if ( RegEnumValue(k, i, vname, &sizen, NULL,
+		      &type, NULL, &size) != ERROR_SUCCESS )
+      break;
+    u->values++;
+    u->bytes += size;
+    u->type_bytes[reg_type_index(type)] += size;
+  }
+}
+
+static void
+add_usage(usage *to, const usage *from)
+{ int i;
+
+  to->keys   += from->keys;
+  to->values += from->values;
+  to->bytes  += from->bytes;
+  to->denied += from->denied;
+  for(i=0; i<=REG_TYPE_COUNT; i++)
+    to->type_bytes[i] += from->type_bytes[i];
+  if ( from->max_depth > to->max_depth )
+    to->max_depth = from->max_depth;
+}
+
+static int
+push_usage_task(usage_job *job, HKEY k, int depth, usage_node *node)
+{ int rc = TRUE;
+
+  EnterCriticalSection(&job->lock);
+  if ( job->count == job->allocated )
+  { int newsize = job->allocated ? job->allocated*2 : 64;
+    usage_task *n = realloc(job->tasks, newsize*sizeof(usage_task));
+
+    if ( n )
+    { job->tasks = n;
+      job->allocated = newsize;
+    } else
+      rc = FALSE;
+  }
+  if ( rc )
+  { usage_task *t = &job->tasks[job->count++];
+
+    t->key   = k;
+    t->depth = depth;
+    t->node  = node;
+    WakeConditionVariable(&job->changed);
+  }
+  LeaveCriticalSection(&job->lock);
+
+  return rc;
+}
+
+static usage_node *
+add_usage_node(usage_job *job, usage_node *parent, const char *name)
+{ usage_node *n;
+
+  if ( (n = calloc(1, sizeof(*n))) )
+  { strcpy(n->name, name);
+    n->depth = parent->depth+1;
+    EnterCriticalSection(&job->lock);
+    n->next = parent->children;
+    parent->children = n;
+    LeaveCriticalSection(&job->lock);
+  }
+
+  return n;
+}
+
+static void
+usage_walk(usage_job *job, HKEY k, int depth, usage_node *node,
+	   usage *u, char *vname)
+{ DWORD i;
+
+  u->keys++;
+  if ( depth > u->max_depth )
+    u->max_depth = depth;
+  count_values(k, u, vname);
+
+  for(i=0;;i++)
+  { char kname[256];
+    DWORD sk = sizeof(kname);
+    usage_node *child = NULL;
+    HKEY sub;
+    LONG rval;
+
+    if ( RegEnumKeyEx(k, i, kname, &sk,
+		      NULL, NULL, NULL, NULL) != ERROR_SUCCESS )
+      break;
+    if ( (rval=RegOpenKeyEx(k, kname, 0L, KEY_READ, &sub)) != ERROR_SUCCESS )
+    { if ( rval == ERROR_ACCESS_DENIED )
+	u->denied++;
+      continue;
+    }
+
+    if ( depth < job->report_depth &&
+	 (child = add_usage_node(job, node, kname)) )
+    { if ( push_usage_task(job, sub, depth+1, child) )
+	continue;
+    } else if ( job->count < job->nthreads &&	/* unlocked: only a hint */
+		push_usage_task(job, sub, depth+1, node) )
+    { continue;
+    }
+
+    if ( child )			/* could not push */
+    { usage cu;
+
+      memset(&cu, 0, sizeof(cu));
+      usage_walk(job, sub, depth+1, child, &cu, vname);
+      EnterCriticalSection(&job->lock);
+      add_usage(&child->usage, &cu);
+      LeaveCriticalSection(&job->lock);
+    } else
+    { usage_walk(job, sub, depth+1, node, u, vname);
+    }
+    RegCloseKey(sub);
+  }
+}
+
+static DWORD WINAPI
+usage_worker(LPVOID closure)
+{ usage_job *job = closure;
+  char *vname;
+
+  if ( !(vname = malloc(MAX_VALUE_NAME)) )
+    return 1;
+
+  for(;;)
+  { usage_task t;
+    usage u;
+
+    EnterCriticalSection(&job->lock);
+    while( job->count == 0 && job->active > 0 )
+      SleepConditionVariableCS(&job->changed, &job->lock, INFINITE);
+    if ( job->count == 0 )
+    { LeaveCriticalSection(&job->lock);
+      break;
+    }
+    t = job->tasks[--job->count];
+    job->active++;
+    LeaveCriticalSection(&job->lock);
+
+    memset(&u, 0, sizeof(u));
+    usage_walk(job, t.key, t.depth, t.node, &u, vname);
+    if ( t.key != job->root )
+      RegCloseKey(t.key);
+
+    EnterCriticalSection(&job->lock);
+    add_usage(&t.node->usage, &u);
+    if ( --job->active == 0 && job->count == 0 )
+      WakeAllConditionVariable(&job->changed);
+    LeaveCriticalSection(&job->lock);
+  }
+
+  free(vname);
+  return 0;
+}
+
+static void
+sum_usage(usage_node *node)
+{ usage_node *c;
+
+  for(c=node->children; c; c=c->next)
+  { sum_usage(c);
+    add_usage(&node->usage, &c->usage);
+  }
+}
+
+static void
+free_usage_nodes(usage_node *n)
+{ while(n)
+  { usage_node *next = n->next;
+
+    free_usage_nodes(n->children);
+    free(n);
+    n = next;
+  }
+}
+
+static int
+compare_usage_node(const void *p1, const void *p2)
+{ const usage_node *n1 = *(const usage_node**)p1;
+  const usage_node *n2 = *(const usage_node**)p2;
+
+  return n1->usage.bytes > n2->usage.bytes ? -1 :
+	 n1->usage.bytes < n2->usage.bytes ?  1 : 0;
+}
+
+static int
+get_usage_options(term_t options, int *threads, int *top, int *depth)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  while(PL_get_list(tail, head, tail))
+  { int *vp;
+
+    if ( PL_is_functor(head, FUNCTOR_threads1) )
+      vp = threads;
+    else if ( PL_is_functor(head, FUNCTOR_top1) )
+      vp = top;
+    else if ( PL_is_functor(head, FUNCTOR_depth1) )
+      vp = depth;
+    else
+      continue;
+
+    _PL_get_arg(1, head, arg);
+    if ( !PL_get_integer(arg, vp) )
+      return PL_type_error("integer", arg);
+    if ( *vp < 0 )
+      return PL_domain_error("not_less_than_zero", arg);
+  }
+  if ( !PL_get_nil(tail) )
+    return PL_type_error("list", options);
+
+  return TRUE;
+}
+
+static int
+unify_usage(term_t stats, const usage_node *node, const usage_job *job,
+	    int top)
+{ const usage *u = &node->usage;
+  term_t tail = PL_copy_term_ref(stats);
+  term_t head = PL_new_term_ref();
+  term_t l2   = PL_new_term_ref();
+  term_t h2   = PL_new_term_ref();
+  int i;
+
+  if ( !PL_unify_list(tail, head, tail) ||
+       !PL_unify_term(head, PL_FUNCTOR_CHARS, "keys", 1,
+			      PL_INT64, u->keys) ||
+       !PL_unify_list(tail, head, tail) ||
+       !PL_unify_term(head, PL_FUNCTOR_CHARS, "values", 1,
+			      PL_INT64, u->values) ||
+       !PL_unify_list(tail, head, tail) ||
+       !PL_unify_term(head, PL_FUNCTOR_CHARS, "bytes", 1,
+			      PL_INT64, u->bytes) ||
+       !PL_unify_list(tail, head, tail) ||
+       !PL_unify_term(head, PL_FUNCTOR_CHARS, "max_depth", 1,
+			      PL_INT, u->max_depth - node->depth) ||
+       !PL_unify_list(tail, head, tail) ||
+       !PL_unify_term(head, PL_FUNCTOR_CHARS, "denied", 1,
+			      PL_INT64, u->denied) )
+    return FALSE;
+
+  if ( !PL_unify_list(tail, head, tail) ||
+       !PL_unify_term(head, PL_FUNCTOR_CHARS, "types", 1,
+			      PL_TERM, l2) )
+    return FALSE;
+  for(i=0; i<=REG_TYPE_COUNT; i++)
+  { if ( u->type_bytes[i] )
+    { if ( !PL_unify_list(l2, h2, l2) ||
+	   !PL_unify_term(h2, PL_FUNCTOR_CHARS, "-", 2,
+			        PL_CHARS, reg_type_names[i],
+			        PL_INT64, u->type_bytes[i]) )
+	return FALSE;
+    }
+  }
+  if ( !PL_unify_nil(l2) )
+    return FALSE;
+
+  if ( node->depth < job->report_depth )
+  { const usage_node *c;
+    const usage_node **children;
+    int count = 0, rc = TRUE;
+
+    for(c=node->children; c; c=c->next)
+      count++;
+    if ( !(children = malloc((count+1)*sizeof(*children))) )
+      return PL_resource_error("memory");
+    count = 0;
+    for(c=node->children; c; c=c->next)
+      children[count++] = c;
+    qsort(children, count, sizeof(*children), compare_usage_node);
+    if ( top < count )
+      count = top;
+
+    l2 = PL_new_term_ref();
+    if ( !PL_unify_list(tail, head, tail) ||
+	 !PL_unify_term(head, PL_FUNCTOR_CHARS, "largest", 1,
+				PL_TERM, l2) )
+      rc = FALSE;
+    for(i=0; rc && i<count; i++)
+    { term_t cstats = PL_new_term_ref();
+
+      rc = ( PL_unify_list(l2, h2, l2) &&
+	     PL_unify_term(h2, PL_FUNCTOR_CHARS, "child", 2,
+			         PL_CHARS, children[i]->name,
+			         PL_TERM, cstats) &&
+	     unify_usage(cstats, children[i], job, top) );
+    }
+    free(children);
+    if ( !rc || !PL_unify_nil(l2) )
+      return FALSE;
+  }
+
+  return PL_unify_nil(tail);
+}
+
+
+foreign_t
+pl_reg_usage(term_t h, term_t options, term_t stats)
+{ HKEY k;
+  usage_job job;
+  usage_node root;
+  SYSTEM_INFO info;
+  HANDLE threads[MAX_USAGE_THREADS];
+  int nthreads, top = 10, depth = 1;
+  int i, created = 0;
+  DWORD rval;
+  int rc;
+
+  if ( !(k = to_key(h)) )
+    PL_fail;
+  GetSystemInfo(&info);
+  nthreads = (int)info.dwNumberOfProcessors;
+  if ( !get_usage_options(options, &nthreads, &top, &depth) )
+    PL_fail;
+  if ( nthreads > MAX_USAGE_THREADS )
+    nthreads = MAX_USAGE_THREADS;
+  if ( nthreads < 1 )
+    nthreads = 1;
+  if ( (rval=RegQueryInfoKey(k, NULL, NULL, NULL, NULL, NULL, NULL,
+			     NULL, NULL, NULL, NULL,
+			     NULL)) != ERROR_SUCCESS )
+    return api_exception(rval, "query", h);
+
+  memset(&job, 0, sizeof(job));
+  memset(&root, 0, sizeof(root));
+  job.root = k;
+  job.nthreads = nthreads;
+  job.report_depth = depth;
+  InitializeCriticalSection(&job.lock);
+  InitializeConditionVariable(&job.changed);
+  if ( !push_usage_task(&job, k, 0, &root) )
+  { DeleteCriticalSection(&job.lock);
+    return PL_resource_error("memory");
+  }
+
+  for(i=1; i<nthreads; i++)		/* we are the first worker */
+  { if ( (threads[created] = CreateThread(NULL, 0, usage_worker,
+					  &job, 0, NULL)) )
+      created++;
+  }
+  usage_worker(&job);
+  for(i=0; i<created; i++)
+  { WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+  DeleteCriticalSection(&job.lock);
+  free(job.tasks);
+
+  sum_usage(&root);
+  rc = unify_usage(stats, &root, &job, top);
+  free_usage_nodes(root.children);
+
+  return rc;
+}
+
+
+		 /*******************************
+		 *	     COPY TREES		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_copy_tree(+Src, +Dst, +Options)
+reg_move_tree(+Src, +Dst, +Options)
+	Copy all values and subkeys of Src to Dst.  reg_move_tree/3
+	deletes the subkeys and values of Src after a successful copy.
+	Src itself is not deleted.  Src and Dst must be disjoint: raises
+	a permission error if they are the same key or one is inside
+	the tree below the other.  If this cannot be determined, the
+	API error is raised and nothing is copied.  Options:
+
+	  - if_exists(+Action)
+	    What to do with values that already exist in Dst.  One of
+	    merge (default, values of Src replace values of Dst), skip
+	    (keep the value of Dst) or overwrite (a subkey of Dst that
+	    also appears in Src is emptied before copying into it).
+	    Values and subkeys of Dst that do not appear in Src are
+	    never deleted.
+
+The walk is done in C using a single  value name and data buffer for the
+entire copy. Each destination key is created or opened exactly once.
+Overlap is detected by comparing the  full   kernel  names of the keys,
+which NtQueryKey() returns for any handle. Only predefined keys are
+reopened to obtain a real handle.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef LONG (NTAPI *NtQueryKey_t)(HANDLE key, int info_class,
+				   PVOID info, ULONG length,
+				   PULONG result_length);
+#define KEY_NAME_INFORMATION_CLASS 3	/* KeyNameInformation */
+
+/* Get the full name of the real key handle k as a malloc'ed,
+   0-terminated wide string.  Fails with ERROR_INVALID_HANDLE if k is
+   not a real handle, such as a predefined key.
+*/
+
+static DWORD
+query_key_name(NtQueryKey_t query, HKEY k, WCHAR **name, size_t *len)
+{ ULONG size = 512, needed;
+  BYTE *info = NULL;
+  DWORD rval = ERROR_NOT_ENOUGH_MEMORY;
+
+  for(;;)
+  { BYTE *n;
+
+    if ( !(n = realloc(info, size)) )
+      break;
+    info = n;
+    if ( (*query)(k, KEY_NAME_INFORMATION_CLASS, info, size, &needed) == 0 )
+    { ULONG bytes = *(ULONG*)info;	/* NameLength */
+
+      if ( (*name = malloc(bytes+sizeof(WCHAR))) )
+      { memcpy(*name, info+sizeof(ULONG), bytes);
+	*len = bytes/sizeof(WCHAR);
+	(*name)[*len] = 0;
+	rval = ERROR_SUCCESS;
+      }
+      break;
+    }
+    if ( needed <= size )		/* not a size problem */
+    { rval = ERROR_INVALID_HANDLE;
+      break;
+    }
+    size = needed;
+  }
+
+  free(info);
+  return rval;
+}
+
+/* Get the full name of k.  The handle itself is queried first, so no
+   additional access is needed for keys opened by the caller.
+*/
+
+static DWORD
+key_full_name(HKEY k, WCHAR **name, size_t *len)
+{ static NtQueryKey_t NtQueryKey_f = NULL;
+  HKEY real;
+  DWORD rval;
+
+  if ( !NtQueryKey_f &&
+       !(NtQueryKey_f = (NtQueryKey_t)GetProcAddress(
+			    GetModuleHandle("ntdll.dll"), "NtQueryKey")) )
+    return GetLastError();
+
+  if ( (rval=query_key_name(NtQueryKey_f, k, name, len)) !=
+       ERROR_INVALID_HANDLE )
+    return rval;
+					/* map predefined keys */
+  if ( (rval=RegOpenKeyEx(k, NULL, 0L, KEY_QUERY_VALUE,
+			  &real)) != ERROR_SUCCESS )
+    return rval;
+  rval = query_key_name(NtQueryKey_f, real, name, len);
+  RegCloseKey(real);
+
+  return rval;
+}
+
+/* Succeed if src and dst are disjoint.  Raise a permission error if
+   they are the same key or one contains the other.  If a name cannot
+   be obtained we cannot tell and raise the API error rather than risk
+   copying a tree into itself.
+*/
+
+static int
+check_disjoint(HKEY src, term_t from, HKEY dst, term_t to, int move)
+{ WCHAR *n1 = NULL, *n2 = NULL;
+  size_t l1, l2;
+  DWORD rval;
+  int rc;
+
+  if ( (rval=key_full_name(src, &n1, &l1)) != ERROR_SUCCESS )
+    return api_exception(rval, "query", from);
+  if ( (rval=key_full_name(dst, &n2, &l2)) != ERROR_SUCCESS )
+  { free(n1);
+    return api_exception(rval, "query", to);
+  }
+
+  { const WCHAR *longer = l1 > l2 ? n1 : n2;
+    size_t shortest = l1 > l2 ? l2 : l1;
+
+    if ( _wcsnicmp(n1, n2, shortest) == 0 &&
+	 ( l1 == l2 || longer[shortest] == L'\\' ) )
+      rc = PL_permission_error(move ? "move" : "copy",
+			       "overlapping_registry_key", to);
+    else
+      rc = TRUE;
+  }
+  free(n1);
+  free(n2);
+
+  return rc;
+}
+
+typedef enum
+{ COPY_MERGE,
+  COPY_SKIP,
+  COPY_OVERWRITE
+} copy_mode;
+
+typedef struct copy_state
+{ copy_mode mode;			/* if_exists(Mode) */
+  char	   *vname;			/* value name buffer */
+  regbuf    data;			/* value data buffer */
+} copy_state;
+
+static DWORD
+copy_values(HKEY src, HKEY dst, copy_state *cs)
+{ DWORD maxdata;
+  DWORD i, rval;
+
+  if ( (rval=RegQueryInfoKey(src, NULL, NULL, NULL, NULL, NULL, NULL,
+			     NULL, NULL, &maxdata, NULL,
+			     NULL)) != ERROR_SUCCESS )
+    return rval;
+  if ( !grow_regbuf(&cs->data, maxdata+1) )
+    return ERROR_NOT_ENOUGH_MEMORY;
+
+  for(i=0;;)
+  { DWORD sizen = MAX_VALUE_NAME;
+    DWORD size = (DWORD)cs->data.allocated;
+    DWORD type;
+
+    rval = RegEnumValue(src, i, cs->vname, &sizen, NULL,
+			&type, cs->data.base, &size);
+    if ( rval == ERROR_MORE_DATA )	/* value grew */
+    { if ( !grow_regbuf(&cs->data, size) )
+	return ERROR_NOT_ENOUGH_MEMORY;
+      continue;
+    }
+    if ( rval == ERROR_NO_MORE_ITEMS )
+      return ERROR_SUCCESS;
+    if ( rval != ERROR_SUCCESS )
+      return rval;
+    i++;
+
+    if ( cs->mode == COPY_SKIP &&
+	 RegQueryValueEx(dst, cs->vname, NULL, NULL,
+			 NULL, NULL) == ERROR_SUCCESS )
+      continue;
+    if ( (rval=RegSetValueEx(dst, cs->vname, 0L, type,
+			     cs->data.base, size)) != ERROR_SUCCESS )
+      return rval;
+  }
+}
+
+static DWORD
+copy_tree(HKEY src, HKEY dst, copy_state *cs)
+{ DWORD i, rval;
+
+  if ( (rval=copy_values(src, dst, cs)) != ERROR_SUCCESS )
+    return rval;
+
+  for(i=0;;i++)
+  { char kname[256];
+    DWORD sk = sizeof(kname);
+    HKEY ssub, dsub;
+    DWORD disp;
+
+    rval = RegEnumKeyEx(src, i, kname, &sk, NULL, NULL, NULL, NULL);
+    if ( rval == ERROR_NO_MORE_ITEMS )
+      return ERROR_SUCCESS;
+    if ( rval != ERROR_SUCCESS )
+      return rval;
+
+    if ( (rval=RegOpenKeyEx(src, kname, 0L, KEY_READ,
+			    &ssub)) != ERROR_SUCCESS )
+      return rval;
+    if ( (rval=RegCreateKeyEx(dst, kname, 0L, NULL,
+			      REG_OPTION_NON_VOLATILE,
+			      cs->mode == COPY_OVERWRITE
+				? KEY_READ|KEY_WRITE|DELETE
+				: KEY_READ|KEY_WRITE, NULL,
+			      &dsub, &disp)) != ERROR_SUCCESS )
+    { RegCloseKey(ssub);
+      return rval;
+    }
+    if ( cs->mode == COPY_OVERWRITE && disp == REG_OPENED_EXISTING_KEY )
+      rval = RegDeleteTree(dsub, NULL);	/* empty, but keep the key */
+    if ( rval == ERROR_SUCCESS )
+      rval = copy_tree(ssub, dsub, cs);
+    RegCloseKey(dsub);
+    RegCloseKey(ssub);
+    if ( rval != ERROR_SUCCESS )
+      return rval;
+  }
+}
+
+static int
+get_copy_options(term_t options, copy_mode *mode)
+{ term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  *mode = COPY_MERGE;
+  while(PL_get_list(tail, head, tail))
+  { if ( PL_is_functor(head, FUNCTOR_if_exists1) )
+    { atom_t a;
+
+      _PL_get_arg(1, head, arg);
+      if ( !PL_get_atom(arg, &a) )
+	return PL_type_error("atom", arg);
+      if ( a == ATOM_merge )
+	*mode = COPY_MERGE;
+      else if ( a == ATOM_skip )
+	*mode = COPY_SKIP;
+      else if ( a == ATOM_overwrite )
+	*mode = COPY_OVERWRITE;
+      else
+	return PL_domain_error("if_exists", arg);
+    }
+  }
+  if ( !PL_get_nil(tail) )
+    return PL_type_error("list", options);
+
+  return TRUE;
+}
+
+static foreign_t
+reg_copy_tree(term_t from, term_t to, term_t options, int move)
+{ HKEY src, dst;
+  copy_state cs;
+  DWORD rval;
+
+  if ( !(src = to_key(from)) || !(dst = to_key(to)) )
+    PL_fail;
+  if ( !get_copy_options(options, &cs.mode) )
+    PL_fail;
+
+  if ( !check_disjoint(src, from, dst, to, move) )
+    PL_fail;
+
+  if ( !(cs.vname = malloc(MAX_VALUE_NAME)) )
+    return PL_resource_error("memory");
+  init_regbuf(&cs.data);
+  rval = copy_tree(src, dst, &cs);
+  free_regbuf(&cs.data);
+  free(cs.vname);
+
+  if ( rval != ERROR_SUCCESS )
+    return api_exception(rval, "copy", to);
+
+  if ( move && (rval=RegDeleteTree(src, NULL)) != ERROR_SUCCESS )
+    return api_exception(rval, "delete", from);
+
+  PL_succeed;
+}
+
+
+foreign_t
+pl_reg_copy_tree(term_t from, term_t to, term_t options)
+{ return reg_copy_tree(from, to, options, FALSE);
+}
+
+
+foreign_t
+pl_reg_move_tree(term_t from, term_t to, term_t options)
+{ return reg_copy_tree(from, to, options, TRUE);
+}
+
+
+		 /*******************************
+		 *	      MATCHING		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_match(+Pattern, +Name, -Path, -Value)
+	Enumerate on backtracking all keys that match Pattern and have a
+	value Name.  Pattern is a path as used by library(registry), where
+	the components after the root may be
+
+	  - *
+	    Matches any subkey.
+	  - **
+	    Matches any sequence of zero or more subkeys.
+	  - A glob pattern
+	    Using *, ? and [...], matched case insensitively.
+	  - A plain name
+	    Opened directly, without enumerating the parent, unless a
+	    wildcard applies at the same position.
+
+	Path is unified with the path of the matching key using the same
+	root as Pattern.  Each matching key is returned once, also if
+	the pattern contains multiple `**` components.
+
+The search is a depth-first walk using an  explicit stack of frames that
+survives backtracking. Each frame holds an  open key, the position of the
+enumeration of its children and the set of pattern positions that apply
+to the key. This set is a bitmask, which   limits  the number of pattern
+components to MAX_MATCH_COMPS.  As  the  walk   follows  all  positions
+together, each key is visited at most once.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define MAX_MATCH_COMPS 63
+#define MSTATE(i) ((uint64_t)1<<(i))
+
+typedef enum
+{ M_FIXED,				/* plain name */
+  M_STAR,				/* * */
+  M_GLOB,				/* glob pattern */
+  M_ANY_DEPTH				/* ** */
+} mtype;
+
+typedef enum
+{ PH_START,				/* frame is new */
+  PH_ENUM,				/* enumerating children */
+  PH_FIXED,				/* opening plain names */
+  PH_DONE				/* frame is exhausted */
+} mphase;
+
+typedef struct mcomp
+{ mtype	 type;				/* M_* */
+  char	*name;				/* name or pattern */
+} mcomp;
+
+typedef struct mframe
+{ HKEY	 key;				/* the key */
+  int	 owned;				/* we must close key */
+  uint64_t states;			/* MSTATE() of applicable positions */
+  mphase phase;				/* PH_* */
+  DWORD	 index;				/* enumeration index */
+  char	 name[256];			/* name of key ("" for the root) */
+} mframe;
+
+typedef struct match_state
+{ mcomp	 *comps;			/* compiled pattern */
+  int	  ncomps;			/* # components */
+  char	 *vname;			/* value name */
+  mframe *stack;			/* search stack */
+  int	  top;				/* # frames in use */
+  int	  allocated;			/* # frames allocated */
+  regbuf  data;				/* value data */
+} match_state;
+
+
+int
+glob_match(const char *p, const char *s)
+{ for(;;)
+  { switch(*p)
+    { case EOS:
+	return *s == EOS;
+      case '*':
+	while(*p == '*')
+	  p++;
+	if ( *p == EOS )
+	  return TRUE;
+	for(; *s; s++)
+	{ if ( glob_match(p, s) )
+	    return TRUE;
+	}
+	return FALSE;
+      case '?':
+	if ( *s == EOS )
+	  return FALSE;
+	p++, s++;
+	break;
+      case '[':
+      { int c = tolower((unsigned char)*s);
+	int neg = FALSE, ok = FALSE;
+
+	if ( *s == EOS )
+	  return FALSE;
+	p++;
+	if ( *p == '!' || *p == '^' )
+	  neg = TRUE, p++;
+	do
+	{ int lo = tolower((unsigned char)*p);
+	  int hi = lo;
+
+	  if ( *p == EOS )
+	    return FALSE;		/* unterminated [ */
+	  if ( p[1] == '-' && p[2] && p[2] != ']' )
+	  { hi = tolower((unsigned char)p[2]);
+	    p += 2;
+	  }
+	  if ( c >= lo && c <= hi )
+	    ok = TRUE;
+	  p++;
+	} while(*p != ']');
+	p++;
+	if ( ok == neg )
+	  return FALSE;
+	s++;
+	break;
+      }
+      default:
+	if ( tolower((unsigned char)*p) != tolower((unsigned char)*s) )
+	  return FALSE;
+	p++, s++;
+    }
+  }
+}
+
+
+static void
+free_match_state(match_state *ms)
+{ int i;
+
+  for(i=0; i<ms->top; i++)
+  { if ( ms->stack[i].owned )
+      RegCloseKey(ms->stack[i].key);
+  }
+  for(i=0; i<ms->ncomps; i++)
+    free(ms->comps[i].name);
+  free(ms->comps);
+  free(ms->stack);
+  free(ms->vname);
+  free_regbuf(&ms->data);
+  free(ms);
+}
+
+
+static int
+push_frame(match_state *ms, HKEY key, int owned, uint64_t states,
+	   const char *name)
+{ mframe *f;
+
+  if ( ms->top == ms->allocated )
+  { int n = ms->allocated ? ms->allocated*2 : 16;
+    mframe *new = realloc(ms->stack, n*sizeof(mframe));
+
+    if ( !new )
+    { if ( owned )
+	RegCloseKey(key);
+      return FALSE;
+    }
+    ms->stack = new;
+    ms->allocated = n;
+  }
+
+  f = &ms->stack[ms->top++];
+  f->key   = key;
+  f->owned = owned;
+  f->states = states;
+  f->phase = PH_START;
+  f->index = 0;
+  strcpy(f->name, name);
+
+  return TRUE;
+}
+
+
+static void
+pop_frame(match_state *ms)
+{ mframe *f = &ms->stack[--ms->top];
+
+  if ( f->owned )
+    RegCloseKey(f->key);
+}
+
+
+/* Compile A/B/... into ms->comps, leaving the root in root
+*/
+
+static int
+compile_pattern(term_t pattern, match_state *ms, term_t root)
+{ if ( PL_is_functor(pattern, FUNCTOR_divide2) )
+  { term_t a = PL_new_term_ref();
+    char *s;
+    mtype type;
+
+    _PL_get_arg(1, pattern, a);
+    if ( !compile_pattern(a, ms, root) )
+      return FALSE;
+    _PL_get_arg(2, pattern, a);
+    if ( !PL_get_atom_chars(a, &s) )
+      return PL_type_error("atom", a);
+
+    if ( ms->ncomps == MAX_MATCH_COMPS )
+      return PL_representation_error("max_registry_pattern_length");
+    if ( strcmp(s, "**") == 0 )
+    { type = M_ANY_DEPTH;
+      if ( ms->ncomps > 0 && ms->comps[ms->ncomps-1].type == M_ANY_DEPTH )
+	return TRUE;			/* ** / ** is ** */
+    } else if ( strcmp(s, "*") == 0 )
+      type = M_STAR;
+    else if ( strpbrk(s, "*?[") )
+      type = M_GLOB;
+    else
+      type = M_FIXED;
+
+    { mcomp *new = realloc(ms->comps, (ms->ncomps+1)*sizeof(mcomp));
+
+      if ( !new )
+	return PL_resource_error("memory");
+      ms->comps = new;
+      if ( !(new[ms->ncomps].name = strdup(s)) )
+	return PL_resource_error("memory");
+      new[ms->ncomps++].type = type;
+    }
+
+    return TRUE;
+  }
+
+  if ( !to_key(pattern) )
+    return PL_domain_error("registry_key", pattern);
+
+  return PL_put_term(root, pattern);
+}
+
+
+static int
+get_pattern_root(term_t pattern, term_t root)
+{ PL_put_term(root, pattern);
+  while(PL_is_functor(root, FUNCTOR_divide2))
+    _PL_get_arg(1, root, root);
+
+  return TRUE;
+}
+
+
+/* Add the positions after a ** as ** also matches zero keys
+*/
+
+static uint64_t
+match_closure(const match_state *ms, uint64_t set)
+{ int i;
+
+  for(i=0; i<ms->ncomps; i++)
+  { if ( (set & MSTATE(i)) && ms->comps[i].type == M_ANY_DEPTH )
+      set |= MSTATE(i+1);
+  }
+
+  return set;
+}
+
+/* The positions that apply to a child called name of a key for which
+   set applies.
+*/
+
+static uint64_t
+match_step(const match_state *ms, uint64_t set, const char *name)
+{ uint64_t next = 0;
+  int i;
+
+  for(i=0; i<ms->ncomps; i++)
+  { const mcomp *c = &ms->comps[i];
+
+    if ( !(set & MSTATE(i)) )
+      continue;
+    switch(c->type)
+    { case M_ANY_DEPTH:
+	next |= MSTATE(i);
+	break;
+      case M_STAR:
+	next |= MSTATE(i+1);
+	break;
+      case M_GLOB:
+	if ( glob_match(c->name, name) )
+	  next |= MSTATE(i+1);
+	break;
+      case M_FIXED:
+	if ( _stricmp(c->name, name) == 0 )
+	  next |= MSTATE(i+1);
+	break;
+    }
+  }
+
+  return match_closure(ms, next);
+}
+
+static int
+only_fixed(const match_state *ms, uint64_t set)
+{ int i;
+
+  for(i=0; i<ms->ncomps; i++)
+  { if ( (set & MSTATE(i)) && ms->comps[i].type != M_FIXED )
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* True if position i of set is a plain name that also appears at an
+   earlier position of set.
+*/
+
+static int
+fixed_seen(const match_state *ms, uint64_t set, int i)
+{ int j;
+
+  for(j=0; j<i; j++)
+  { if ( (set & MSTATE(j)) &&
+	 _stricmp(ms->comps[j].name, ms->comps[i].name) == 0 )
+      return TRUE;
+  }
+
+  return FALSE;
+}
+
+
+/* Advance the search to the next key that matches the pattern and has
+   the requested value.  Returns TRUE if such a key is found, leaving
+   the value in ms->data and the key on top of the stack.
+*/
+
+static int
+next_match(match_state *ms, DWORD *type)
+{ while(ms->top > 0)
+  { mframe *f = &ms->stack[ms->top-1];
+
+    switch(f->phase)
+    { case PH_START:
+      { uint64_t pending = f->states & ~MSTATE(ms->ncomps);
+
+	f->phase = ( !pending		  ? PH_DONE :
+		     only_fixed(ms, pending) ? PH_FIXED : PH_ENUM );
+	if ( (f->states & MSTATE(ms->ncomps)) &&
+	     query_value(f->key, ms->vname, type, &ms->data) == ERROR_SUCCESS )
+	  return TRUE;
+	continue;
+      }
+      case PH_FIXED:
+      { int i = (int)f->index++;
+	const char *name;
+	HKEY sub;
+
+	if ( i >= ms->ncomps )
+	{ f->phase = PH_DONE;
+	  continue;
+	}
+	if ( !(f->states & MSTATE(i)) || fixed_seen(ms, f->states, i) )
+	  continue;
+	name = ms->comps[i].name;
+	if ( strlen(name) < sizeof(f->name) &&
+	     RegOpenKeyEx(f->key, name, 0L,
+			  KEY_READ, &sub) == ERROR_SUCCESS &&
+	     !push_frame(ms, sub, TRUE,
+			 match_step(ms, f->states, name), name) )
+	{ PL_resource_error("memory");
+	  return FALSE;
+	}
+	continue;
+      }
+      case PH_ENUM:
+      { char kname[256];
+	DWORD sk = sizeof(kname);
+	uint64_t next;
+	HKEY sub;
+
+	if ( RegEnumKeyEx(f->key, f->index++, kname, &sk,
+			  NULL, NULL, NULL, NULL) != ERROR_SUCCESS )
+	{ f->phase = PH_DONE;
+	  continue;
+	}
+	if ( !(next = match_step(ms, f->states, kname)) )
+	  continue;
+	if ( RegOpenKeyEx(f->key, kname, 0L, KEY_READ, &sub) == ERROR_SUCCESS &&
+	     !push_frame(ms, sub, TRUE, next, kname) )
+	{ PL_resource_error("memory");
+	  return FALSE;
+	}
+	continue;
+      }
+      case PH_DONE:
+	pop_frame(ms);
+	continue;
+    }
+  }
+
+  return FALSE;
+}
+
+
+static int
+unify_match(match_state *ms, term_t pattern, term_t path, term_t value,
+	    DWORD type)
+{ term_t t = PL_new_term_ref();
+  term_t n = PL_new_term_ref();
+  int i;
+
+  get_pattern_root(pattern, t);
+  for(i=1; i<ms->top; i++)
+  { if ( ms->stack[i].name[0] )
+    { if ( !PL_put_atom_chars(n, ms->stack[i].name) ||
+	   !PL_cons_functor(t, FUNCTOR_divide2, t, n) )
+	return FALSE;
+    }
+  }
+
+  return ( PL_unify(path, t) &&
+	   unify_value(value, type, ms->data.base, (DWORD)ms->data.size,
+		       &default_options) );
+}
+
+
+foreign_t
+pl_reg_match(term_t pattern, term_t name, term_t path, term_t value,
+	     control_t h)
+{ match_state *ms;
+  DWORD type;
+
+  switch(PL_foreign_control(h))
+  { case PL_FIRST_CALL:
+    { term_t root = PL_new_term_ref();
+      char *vname;
+
+      if ( !PL_get_atom_chars(name, &vname) )
+	return PL_type_error("atom", name);
+      if ( !(ms = calloc(1, sizeof(*ms))) )
+	return PL_resource_error("memory");
+      init_regbuf(&ms->data);
+      if ( !(ms->vname = strdup(vname)) )
+      { free_match_state(ms);
+	return PL_resource_error("memory");
+      }
+      if ( !compile_pattern(pattern, ms, root) ||
+	   !push_frame(ms, to_key(root), FALSE,
+		       match_closure(ms, MSTATE(0)), "") )
+      { free_match_state(ms);
+	PL_fail;
+      }
+      break;
+    }
+    case PL_REDO:
+      ms = PL_foreign_context_address(h);
+      break;
+    case PL_PRUNED:
+      ms = PL_foreign_context_address(h);
+      free_match_state(ms);
+      PL_succeed;
+    default:
+      assert(0);
+      PL_fail;
+  }
+
+  while(next_match(ms, &type))
+  { fid_t fid = PL_open_foreign_frame();
+
+    if ( unify_match(ms, pattern, path, value, type) )
+    { PL_close_foreign_frame(fid);
+      PL_retry_address(ms);
+    }
+    if ( PL_exception(0) )
+      break;
+    PL_discard_foreign_frame(fid);
+  }
+
+  free_match_state(ms);
+  PL_fail;
+}
+
+
+		 /*******************************
+		 *	   BATCHED READS	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_get_values(+Requests, -Results)
+	Requests is a list of Path-Name pairs, where Path is a path as
+	used by library(registry).  Results is a list of the same length
+	holding value(Value) for each value that exists and `missing` if
+	the key or value does not exist.
+
+The paths are merged into a  trie  of   open  keys,  such that each key
+shared by multiple paths is opened  only   once.  Key names are compared
+case insensitively, as in the registry.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct pnode
+{ const char   *name;			/* name (NULL for a root) */
+  HKEY		key;			/* the open key */
+  int		owned;			/* we must close key */
+  int		missing;		/* key does not exist */
+  struct pnode *children;		/* first child */
+  struct pnode *next;			/* next sibling */
+} pnode;
+
+static void
+free_pnodes(pnode *n)
+{ while(n)
+  { pnode *next = n->next;
+
+    free_pnodes(n->children);
+    if ( n->owned )
+      RegCloseKey(n->key);
+    free(n);
+    n = next;
+  }
+}
+
+static pnode *
+new_pnode(pnode **list, const char *name, HKEY key)
+{ pnode *n;
+
+  if ( !(n = calloc(1, sizeof(*n))) )
+  { PL_resource_error("memory");
+    return NULL;
+  }
+  n->name = name;
+  n->key  = key;
+  n->next = *list;
+  *list = n;
+
+  return n;
+}
+
+/* resolve_path() returns the trie node for path or NULL after raising
+   an exception.
+*/
+
+static pnode *
+resolve_path(term_t path, pnode **roots)
+{ pnode *n;
+
+  if ( PL_is_functor(path, FUNCTOR_divide2) )
+  { term_t a = PL_new_term_ref();
+    pnode *parent;
+    char *s;
+    DWORD rval;
+
+    _PL_get_arg(1, path, a);
+    if ( !(parent = resolve_path(a, roots)) )
+      return NULL;
+    _PL_get_arg(2, path, a);
+    if ( !PL_get_atom_chars(a, &s) )
+    { PL_type_error("atom", a);
+      return NULL;
+    }
+    if ( parent->missing )
+      return parent;
+
+    for(n=parent->children; n; n=n->next)
+    { if ( _stricmp(n->name, s) == 0 )
+	return n;
+    }
+    if ( !(n = new_pnode(&parent->children, s, 0)) )
+      return NULL;
+    rval = RegOpenKeyEx(parent->key, s, 0L, KEY_READ, &n->key);
+    if ( rval == ERROR_SUCCESS )
+      n->owned = TRUE;
+    else if ( rval == ERROR_FILE_NOT_FOUND )
+      n->missing = TRUE;
+    else
+    { api_exception(rval, "open", a);
+      return NULL;
+    }
+
+    return n;
+  } else
+  { HKEY k;
+
+    if ( !(k = to_key(path)) )
+    { PL_domain_error("registry_key", path);
+      return NULL;
+    }
+    for(n=*roots; n; n=n->next)
+    { if ( n->key == k )
+	return n;
+    }
+
+    return new_pnode(roots, NULL, k);
+  }
+}
+
+
+foreign_t
+pl_reg_get_values(term_t requests, term_t results)
+{ term_t tail  = PL_copy_term_ref(requests);
+  term_t head  = PL_new_term_ref();
+  term_t rtail = PL_copy_term_ref(results);
+  term_t rhead = PL_new_term_ref();
+  term_t path  = PL_new_term_ref();
+  term_t name  = PL_new_term_ref();
+  term_t value = PL_new_term_ref();
+  pnode *roots = NULL;
+  regbuf b;
+  int rc = TRUE;
+
+  init_regbuf(&b);
+  while( rc && PL_get_list(tail, head, tail) )
+  { pnode *n;
+    char *vname;
+    DWORD rval, type;
+
+    if ( !PL_is_functor(head, FUNCTOR_minus2) )
+    { rc = PL_type_error("pair", head);
+      break;
+    }
+    _PL_get_arg(1, head, path);
+    _PL_get_arg(2, head, name);
+    if ( !PL_get_atom_chars(name, &vname) )
+    { rc = PL_type_error("atom", name);
+      break;
+    }
+    if ( !(n = resolve_path(path, &roots)) ||
+	 !PL_unify_list(rtail, rhead, rtail) )
+    { rc = FALSE;
+      break;
+    }
+
+    if ( n->missing )
+    { rc = PL_unify_atom(rhead, ATOM_missing);
+    } else if ( (rval=query_value(n->key, vname,
+				  &type, &b)) == ERROR_SUCCESS )
+    { PL_put_variable(value);
+      rc = ( unify_value(value, type, b.base, (DWORD)b.size,
+			 &default_options) &&
+	     PL_unify_term(rhead, PL_FUNCTOR, FUNCTOR_value1,
+				    PL_TERM, value) );
+    } else if ( rval == ERROR_FILE_NOT_FOUND )
+    { rc = PL_unify_atom(rhead, ATOM_missing);
+    } else
+    { rc = api_exception(rval, "read", path);
+    }
+  }
+  if ( rc && !PL_get_nil(tail) )
+    rc = PL_type_error("list", requests);
+  if ( rc )
+    rc = PL_unify_nil(rtail);
+
+  free_regbuf(&b);
+  free_pnodes(roots);
+
+  return rc;
+}
+
+
+		 /*******************************
+		 *	   SAVE/RESTORE		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_save_key(+Key, +File)
+	Save Key and all its subkeys and values to File using the native
+	registry hive format.  File may not exist.
+reg_restore_key(+Key, +File, +Options)
+	Replace the subkeys and values of Key by the content of File as
+	created by reg_save_key/2.  Options:
+
+	  - force(+Bool)
+	    Restore even if there are open handles to subkeys of Key.
+	  - volatile(+Bool)
+	    Make the restored data volatile.  Only valid for keys
+	    directly below local_machine or users.
+
+Both use the system to stream the data   to  and from the file, so large
+trees are never represented in Prolog. Saving and restoring requires the
+SeBackupPrivilege and SeRestorePrivilege. These are   enabled on the
+process token for the duration of the call and  reset to their previous
+state afterwards. If the user does not hold them, a permission error is
+raised whose message names the missing privilege. As the token is shared by all threads, the privilege_lock makes
+sure concurrent calls do not reset the privileges under each other.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define MAX_PRIVILEGES 2
+
+typedef struct privilege_set
+{ DWORD		      PrivilegeCount;	/* layout of TOKEN_PRIVILEGES */
+  LUID_AND_ATTRIBUTES Privileges[MAX_PRIVILEGES];
+} privilege_set;
+
+typedef struct saved_privileges
+{ HANDLE	token;			/* process token */
+  privilege_set	previous;		/* privileges we changed */
+} saved_privileges;
+
+static CRITICAL_SECTION privilege_lock;
+
+static void
+restore_privileges(saved_privileges *saved)
+{ if ( saved->token )
+  { if ( saved->previous.PrivilegeCount > 0 )
+      AdjustTokenPrivileges(saved->token, FALSE,
+			    (TOKEN_PRIVILEGES*)&saved->previous,
+			    0, NULL, NULL);
+    CloseHandle(saved->token);
+    saved->token = NULL;
+  }
+  LeaveCriticalSection(&privilege_lock);
+}
+
+/* Return the first of the count privileges in tp that token does not
+   hold, or NULL if this cannot be determined.
+*/
+
+static const char *
+missing_privilege(HANDLE token, int count, const char **names,
+		  const privilege_set *tp)
+{ TOKEN_PRIVILEGES *held;
+  DWORD size = 0, j;
+  const char *missing = NULL;
+  int i;
+
+  GetTokenInformation(token, TokenPrivileges, NULL, 0, &size);
+  if ( !(held = malloc(size)) )
+    return NULL;
+  if ( GetTokenInformation(token, TokenPrivileges, held, size, &size) )
+  { for(i=0; i<count && !missing; i++)
+    { const LUID *luid = &tp->Privileges[i].Luid;
+
+      for(j=0; j<held->PrivilegeCount; j++)
+      { if ( held->Privileges[j].Luid.LowPart  == luid->LowPart &&
+	     held->Privileges[j].Luid.HighPart == luid->HighPart )
+	  break;
+      }
+      if ( j == held->PrivilegeCount )
+	missing = names[i];
+    }
+  }
+  free(held);
+
+  return missing;
+}
+
+/* Enable the named privileges, saving the old state in saved.  On
+   success the caller must call restore_privileges().  Returns
+   ERROR_NOT_ALL_ASSIGNED if the user does not hold all privileges,
+   setting *missing to the name of a privilege that is not held.
+*/
+
+static DWORD
+enable_privileges(int count, const char **names, saved_privileges *saved,
+		  const char **missing)
+{ privilege_set tp;
+  DWORD size = sizeof(saved->previous);
+  DWORD rval;
+  int i;
+
+  *missing = NULL;
+  EnterCriticalSection(&privilege_lock);
+  memset(saved, 0, sizeof(*saved));
+  if ( !OpenProcessToken(GetCurrentProcess(),
+			 TOKEN_ADJUST_PRIVILEGES|TOKEN_QUERY, &saved->token) )
+  { rval = GetLastError();
+    saved->token = NULL;
+    goto error;
+  }
+
+  tp.PrivilegeCount = count;
+  for(i=0; i<count; i++)
+  { tp.Privileges[i].Attributes = SE_PRIVILEGE_ENABLED;
+    if ( !LookupPrivilegeValue(NULL, names[i], &tp.Privileges[i].Luid) )
+    { rval = GetLastError();
+      goto error;
+    }
+  }
+  if ( !AdjustTokenPrivileges(saved->token, FALSE, (TOKEN_PRIVILEGES*)&tp,
+			      size, (TOKEN_PRIVILEGES*)&saved->previous,
+			      &size) )
+  { rval = GetLastError();
+    saved->previous.PrivilegeCount = 0;
+    goto error;
+  }
+  if ( (rval=GetLastError()) == ERROR_NOT_ALL_ASSIGNED )
+  { *missing = missing_privilege(saved->token, count, names, &tp);
+    goto error;
+  }
+
+  return ERROR_SUCCESS;
+
+error:
+  restore_privileges(saved);
+  return rval;
+}
+
+
+static int
+privilege_exception(DWORD err, const char *action, term_t key,
+		    const char *missing)
+{ char msg[MSG_MAX_LEN];
+
+  if ( !missing )
+    return api_exception(err, action, key);
+  snprintf(msg, sizeof(msg), "%s is not held", missing);
+
+  return api_exception_context(err, action, key, msg);
+}
+
+
+foreign_t
+pl_reg_save_key(term_t h, term_t file)
+{ HKEY k;
+  char *fname;
+  DWORD rval;
+  static const char *privileges[] = { SE_BACKUP_NAME };
+  saved_privileges saved;
+  const char *missing;
+
+  if ( !(k = to_key(h)) ||
+       !PL_get_file_name(file, &fname, PL_FILE_OSPATH) )
+    PL_fail;
+
+  if ( (rval=enable_privileges(1, privileges,
+			       &saved, &missing)) != ERROR_SUCCESS )
+    return privilege_exception(rval, "save", h, missing);
+  rval = RegSaveKeyEx(k, fname, NULL, REG_LATEST_FORMAT);
+  restore_privileges(&saved);
+  if ( rval == ERROR_SUCCESS )
+    PL_succeed;
+
+  return api_exception(rval, "save", h);
+}
+
+
+foreign_t
+pl_reg_restore_key(term_t h, term_t file, term_t options)
+{ HKEY k;
+  char *fname;
+  DWORD rval;
+  DWORD flags = 0;
+  static const char *privileges[] = { SE_BACKUP_NAME, SE_RESTORE_NAME };
+  saved_privileges saved;
+  const char *missing;
+  term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+
+  if ( !(k = to_key(h)) ||
+       !PL_get_file_name(file, &fname, PL_FILE_OSPATH) )
+    PL_fail;
+
+  while(PL_get_list(tail, head, tail))
+  { DWORD flag;
+    int val;
+
+    if ( PL_is_functor(head, FUNCTOR_force1) )
+      flag = REG_FORCE_RESTORE;
+    else if ( PL_is_functor(head, FUNCTOR_volatile1) )
+      flag = REG_WHOLE_HIVE_VOLATILE;
+    else
+      continue;
+
+    _PL_get_arg(1, head, arg);
+    if ( !PL_get_bool(arg, &val) )
+      return PL_type_error("bool", arg);
+    if ( val )
+      flags |= flag;
+    else
+      flags &= ~flag;
+  }
+  if ( !PL_get_nil(tail) )
+    return PL_type_error("list", options);
+
+  if ( (rval=enable_privileges(2, privileges,
+			       &saved, &missing)) != ERROR_SUCCESS )
+    return privilege_exception(rval, "restore", h, missing);
+  rval = RegRestoreKey(k, fname, flags);
+  restore_privileges(&saved);
+  if ( rval == ERROR_SUCCESS )
+    PL_succeed;
+
+  return api_exception(rval, "restore", h);
+}
+
+
+		 /*******************************
+		 *	   VALUE STREAMS	*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_open_value_stream(+Key, +Name, +Mode, -Stream)
+	Open a binary stream on the data of a value.  Mode is one of
+
+	  - read
+	    Read the data of the value.  The data is read into a buffer
+	    when the stream is opened and is delivered from there.  The
+	    terminating 0-byte of REG_SZ and REG_EXPAND_SZ values is not
+	    part of the stream.
+	  - write
+	  - write(+Type)
+	    Collect the data written and store it as the new value on
+	    close.  Type is one of binary (default), sz or expand_sz.
+	    For the string types a terminating 0-byte is added.
+
+	The write stream uses its own handle for Key, so the caller may
+	close Key before closing the stream.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef struct value_stream
+{ HKEY	 key;				/* Own handle (write) */
+  char	*name;				/* Value name (write) */
+  DWORD	 type;				/* Value type */
+  regbuf buf;				/* The data */
+  size_t here;				/* Read pointer */
+} value_stream;
+
+static void
+free_value_stream(value_stream *vs)
+{ if ( vs->key )
+    RegCloseKey(vs->key);
+  if ( vs->name )
+    free(vs->name);
+  free_regbuf(&vs->buf);
+  free(vs);
+}
+
+static ssize_t
+Sread_value(void *handle, char *buf, size_t size)
+{ value_stream *vs = handle;
+  size_t left = vs->buf.size - vs->here;
+
+  if ( size > left )
+    size = left;
+  memcpy(buf, vs->buf.base+vs->here, size);
+  vs->here += size;
+
+  return size;
+}
+
+static ssize_t
+Swrite_value(void *handle, char *buf, size_t size)
+{ value_stream *vs = handle;
+
+  if ( !add_regbuf(&vs->buf, buf, size) )
+    return -1;
+
+  return size;
+}
+
+static int
+Sclose_value(void *handle)
+{ value_stream *vs = handle;
+  int rc = 0;
+
+  if ( vs->key )
+  { if ( vs->type != REG_BINARY &&
+	 !add_regbuf(&vs->buf, "", 1) )
+      rc = -1;
+    else if ( vs->buf.size > (DWORD)~0 ||
+	      RegSetValueEx(vs->key, vs->name, 0L, vs->type,
+			    vs->buf.base, (DWORD)vs->buf.size) != ERROR_SUCCESS )
+      rc = -1;
+  }
+  free_value_stream(vs);
+
+  return rc;
+}
+
+static IOFUNCTIONS value_functions =
+{ Sread_value,
+  Swrite_value,
+  NULL,					/* seek */
+  Sclose_value,
+  NULL,					/* control */
+  NULL					/* seek64 */
+};
+
+
+static int
+get_stream_mode(term_t mode, int *write, DWORD *type)
+{ atom_t a;
+
+  *type = REG_BINARY;
+  if ( PL_get_atom(mode, &a) )
+  { if ( a == ATOM_read )
+    { *write = FALSE;
+      return TRUE;
+    }
+    if ( a == ATOM_write )
+    { *write = TRUE;
+      return TRUE;
+    }
+  } else if ( PL_is_functor(mode, FUNCTOR_write1) )
+  { term_t arg = PL_new_term_ref();
+
+    _PL_get_arg(1, mode, arg);
+    if ( !PL_get_atom(arg, &a) )
+      return PL_type_error("atom", arg);
+    if ( a == ATOM_binary )
+      *type = REG_BINARY;
+    else if ( a == ATOM_sz )
+      *type = REG_SZ;
+    else if ( a == ATOM_expand_sz )
+      *type = REG_EXPAND_SZ;
+    else
+      return PL_domain_error("registry_type", arg);
+    *write = TRUE;
+    return TRUE;
+  }
+
+  return PL_domain_error("io_mode", mode);
+}
+
+
+foreign_t
+pl_reg_open_value_stream(term_t h, term_t name, term_t mode, term_t stream)
+{ HKEY k;
+  char *vname;
+  int write;
+  DWORD type, rval;
+  value_stream *vs;
+  IOSTREAM *s;
+
+  if ( !(k = to_key(h)) || !PL_get_atom_chars(name, &vname) )
+    PL_fail;
+  if ( !get_stream_mode(mode, &write, &type) )
+    PL_fail;
+
+  if ( !(vs = calloc(1, sizeof(*vs))) )
+    return PL_resource_error("memory");
+  init_regbuf(&vs->buf);
+  vs->type = type;
+
+  if ( write )
+  { if ( (rval = RegOpenKeyEx(k, NULL, 0L, KEY_SET_VALUE,
+			      &vs->key)) != ERROR_SUCCESS )
+    { vs->key = 0;
+      free_value_stream(vs);
+      return api_exception(rval, "write", h);
+    }
+    if ( !(vs->name = strdup(vname)) )
+    { free_value_stream(vs);
+      return PL_resource_error("memory");
+    }
+  } else
+  { if ( (rval = query_value(k, vname, &vs->type,
+			     &vs->buf)) != ERROR_SUCCESS )
+    { free_value_stream(vs);
+      if ( rval == ERROR_FILE_NOT_FOUND )
+	return PL_existence_error("registry_value", name);
+      return api_exception(rval, "read", h);
+    }
+    TRACE_DATA(vs->type, vs->buf.size);
+    if ( (vs->type == REG_SZ || vs->type == REG_EXPAND_SZ) &&
+	 vs->buf.size > 0 && vs->buf.base[vs->buf.size-1] == 0 )
+      vs->buf.size--;
+  }
+
+  if ( !(s = Snew(vs,
+		  (write ? SIO_OUTPUT : SIO_INPUT)|SIO_FBUF|SIO_RECORDPOS,
+		  &value_functions)) )
+  { free_value_stream(vs);
+    return PL_resource_error("memory");
+  }
+  s->encoding = ENC_OCTET;
+
+  return PL_unify_stream(stream, s);
+}
+
+		 /*******************************
+		 *	      WATCHING		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_watch_tree(+Root, +Queue, +Options)
+	Watch the tree below Root and send a message
+
+	    registry_change(Id, Event)
+
+	to the message queue Queue for each change, where Event is one of
+
+	  - key_added(Path)
+	  - key_deleted(Path)
+	  - value_added(Path, Name, Value)
+	  - value_changed(Path, Name, Value)
+	  - value_deleted(Path, Name)
+	  - watch_error(Message)
+	    Watching failed, e.g., because the root was deleted.  No
+	    more events are sent and the mirror may be stale.  The
+	    watch must still be removed using reg_unwatch_tree/1.
+
+	Path is a list of key names relative to Root.  For a new key,
+	key_added/1 and value_added/3 events are sent for the key and
+	everything below it.  For a deleted key only key_deleted/1 is
+	sent.  Options:
+
+	  - id(?Id)
+	    Unified with the integer that identifies the watch.
+	  - initial(+Bool)
+	    If true, first send events describing the current content.
+	    These are sent by the watch thread after reg_watch_tree/3
+	    returns, so Queue may be bounded and read by the caller.
+
+	All changes made after reg_watch_tree/3 returns are reported.
+	If Queue is full, the watch thread waits for room, checking
+	for reg_unwatch_tree/1 every SEND_TIMEOUT seconds.
+reg_unwatch_tree(+Id)
+	Stop watching.
+
+Each watch runs a thread with a Prolog engine that waits for the `notify`
+event of Root and keeps a snapshot of the tree. On a notification it
+compares the last-write time of each  key   with  the snapshot and only
+re-reads the values and subkey names of   keys  whose time has changed.
+Values are compared using their type, size and a hash of their data.
+A subkey that is listed but cannot be opened is considered unchanged,
+rather than deleted.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#define MAX_WATCH_DEPTH 512
+
+typedef struct wvalue
+{ char	       *name;			/* value name */
+  DWORD		type;			/* value type */
+  DWORD		size;			/* size of the data */
+  uint64_t	hash;			/* hash of the data */
+  struct wvalue *next;			/* next value of the key */
+} wvalue;
+
+typedef struct wkey
+{ char	       *name;			/* key name */
+  FILETIME	written;		/* last-write time */
+  wvalue       *values;			/* values of the key */
+  struct wkey  *children;		/* subkeys */
+  struct wkey  *next;			/* next sibling */
+} wkey;
+
+typedef struct watcher
+{ int		id;			/* identifier */
+  HKEY		root;			/* own handle to the root */
+  record_t	queue;			/* message queue */
+  int		initial;		/* report initial content */
+  HANDLE	changed;		/* notification event */
+  HANDLE	stop;			/* request to stop */
+  HANDLE	ready;			/* snapshot is complete */
+  HANDLE	thread;			/* watching thread */
+  DWORD		error;			/* error during startup */
+  int		stopping;		/* stop was seen while sending */
+  wkey	       *snapshot;		/* last known state */
+  char	       *vname;			/* value name buffer */
+  regbuf	data;			/* value data buffer */
+  const char   *path[MAX_WATCH_DEPTH];	/* path of current key */
+  struct watcher *next;			/* next watcher */
+} watcher;
+
+static watcher *watchers = NULL;
+static LONG watch_id = 0;
+static CRITICAL_SECTION watch_lock;
+static predicate_t PRED_thread_send_message3;
+
+static uint64_t
+hash_data(const BYTE *data, DWORD size)
+{ uint64_t h = 0xcbf29ce484222325ULL;	/* FNV-1a */
+  DWORD i;
+
+  for(i=0; i<size; i++)
+  { h ^= data[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+static void
+free_wvalues(wvalue *v)
+{ while(v)
+  { wvalue *next = v->next;
+
+    free(v->name);
+    free(v);
+    v = next;
+  }
+}
+
+static void
+free_wkeys(wkey *k)
+{ while(k)
+  { wkey *next = k->next;
+
+    free_wkeys(k->children);
+    free_wvalues(k->values);
+    free(k->name);
+    free(k);
+    k = next;
+  }
+}
+
+
+static int
+put_watch_path(watcher *w, int depth, term_t list)
+{ term_t h = PL_new_term_ref();
+
+  PL_put_nil(list);
+  while(depth-- > 0)
+  { if ( !PL_put_atom_chars(h, w->path[depth]) ||
+	 !PL_cons_list(list, h, list) )
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Send registry_change(Id, Event) to the queue.  Errors, such as a
+   queue that no longer exists, are ignored.
+*/
+
+#define SEND_TIMEOUT 0.25		/* seconds between checks for stop */
+
+static int
+unify_event(term_t event, watcher *w, functor_t f, int depth,
+	    const char *name, DWORD type, const BYTE *data, DWORD size)
+{ term_t path = PL_new_term_ref();
+  term_t val  = PL_new_term_ref();
+
+  if ( f == FUNCTOR_watch_error1 )	/* name is the message */
+    return PL_unify_term(event, PL_FUNCTOR, f, PL_CHARS, name);
+  if ( !put_watch_path(w, depth, path) )
+    return FALSE;
+  if ( f == FUNCTOR_key_added1 || f == FUNCTOR_key_deleted1 )
+    return PL_unify_term(event, PL_FUNCTOR, f, PL_TERM, path);
+  if ( f == FUNCTOR_value_deleted2 )
+    return PL_unify_term(event, PL_FUNCTOR, f,
+				  PL_TERM, path,
+				  PL_CHARS, name);
+
+  return ( unify_value(val, type, data, size, &default_options) &&
+	   PL_unify_term(event, PL_FUNCTOR, f,
+				  PL_TERM, path,
+				  PL_CHARS, name,
+				  PL_TERM, val) );
+}
+
+/* Send an event to the queue.  If the queue is full, retry with a
+   timeout until the message is sent or reg_unwatch_tree/1 asks us to
+   stop, in which case w->stopping is set and the walk is abandoned.
+*/
+
+static void
+report(watcher *w, functor_t f, int depth, const char *name,
+       DWORD type, const BYTE *data, DWORD size)
+{ fid_t fid;
+
+  if ( w->stopping || !(fid = PL_open_foreign_frame()) )
+    return;
+
+  { term_t av	 = PL_new_term_refs(3);
+    term_t event = PL_new_term_ref();
+
+    if ( PL_recorded(w->queue, av+0) &&
+	 unify_event(event, w, f, depth, name, type, data, size) &&
+	 PL_unify_term(av+1, PL_FUNCTOR, FUNCTOR_registry_change2,
+			       PL_INT, w->id,
+			       PL_TERM, event) &&
+	 PL_unify_term(av+2, PL_LIST, 1,
+			       PL_FUNCTOR_CHARS, "timeout", 1,
+			         PL_FLOAT, SEND_TIMEOUT) )
+    { for(;;)
+      { qid_t qid = PL_open_query(NULL, PL_Q_NODEBUG|PL_Q_CATCH_EXCEPTION,
+				  PRED_thread_send_message3, av);
+	int sent = PL_next_solution(qid);
+	int error = (!sent && PL_exception(qid));
+
+	PL_cut_query(qid);
+	if ( sent || error )		/* error: e.g., queue is gone */
+	  break;
+	if ( WaitForSingleObject(w->stop, 0) == WAIT_OBJECT_0 )
+	{ w->stopping = TRUE;
+	  break;
+	}
+      }
+    }
+  }
+
+  PL_discard_foreign_frame(fid);
+}
+
+
+static void
+report_error(watcher *w, DWORD err)
+{ char msg[MSG_MAX_LEN];
+
+  report(w, FUNCTOR_watch_error1, 0, APIError(err, msg, sizeof(msg)),
+	 0, NULL, 0);
+}
+
+
+static wvalue *
+take_wvalue(wvalue **list, const char *name)
+{ wvalue **vp, *v;
+
+  for(vp=list; (v=*vp); vp=&v->next)
+  { if ( _stricmp(v->name, name) == 0 )
+    { *vp = v->next;
+      return v;
+    }
+  }
+
+  return NULL;
+}
+
+/* Re-read the values of k and report the differences with node if
+   report_changes is TRUE.
+*/
+
+static DWORD
+diff_values(watcher *w, HKEY k, wkey *node, int depth, int report_changes)
+{ wvalue *old = node->values;
+  wvalue *new = NULL, **tail = &new;
+  DWORD i, rval;
+
+  for(i=0;;)
+  { DWORD sizen = MAX_VALUE_NAME;
+    DWORD size  = (DWORD)w->data.allocated-2;
+    DWORD type;
+    wvalue *v, *prev;
+
+    rval = RegEnumValue(k, i, w->vname, &sizen, NULL,
+			&type, w->data.base, &size);
+    if ( rval == ERROR_MORE_DATA )
+    { if ( !grow_regbuf(&w->data, (size_t)size+2) )
+      { rval = ERROR_NOT_ENOUGH_MEMORY;
+	break;
+      }
+      continue;
+    }
+    if ( rval != ERROR_SUCCESS )
+      break;
+    i++;
+    if ( w->stopping )
+    { rval = ERROR_CANCELLED;
+      break;
+    }
+
+    if ( !(v = calloc(1, sizeof(*v))) ||
+	 !(v->name = strdup(w->vname)) )
+    { free(v);
+      rval = ERROR_NOT_ENOUGH_MEMORY;
+      break;
+    }
+    v->type = type;
+    v->size = size;
+    v->hash = hash_data(w->data.base, size);
+    *tail = v;
+    tail = &v->next;
+
+    if ( !report_changes )
+      continue;
+    w->data.base[size] = 0;		/* terminate strings */
+    w->data.base[size+1] = 0;
+    if ( !(prev = take_wvalue(&old, v->name)) )
+    { report(w, FUNCTOR_value_added3, depth, v->name,
+	     type, w->data.base, size);
+    } else
+    { if ( prev->type != v->type || prev->size != v->size ||
+	   prev->hash != v->hash )
+	report(w, FUNCTOR_value_changed3, depth, v->name,
+	       type, w->data.base, size);
+      free_wvalues(prev);
+    }
+  }
+
+  if ( rval != ERROR_NO_MORE_ITEMS )	/* keep what we have */
+  { *tail = old;
+    node->values = new;
+    return rval;
+  }
+
+  if ( report_changes )
+  { wvalue *v;
+
+    for(v=old; v; v=v->next)
+      report(w, FUNCTOR_value_deleted2, depth, v->name, 0, NULL, 0);
+  }
+  free_wvalues(old);
+  node->values = new;
+
+  return ERROR_SUCCESS;
+}
+
+
+/* Create a snapshot for the key k, called name.  If report_changes is
+   TRUE, report the content as added.
+*/
+
+static wkey *
+read_wkey(watcher *w, HKEY k, const char *name, int depth,
+	  int report_changes)
+{ wkey *node, **tail;
+  DWORD i;
+
+  if ( !(node = calloc(1, sizeof(*node))) ||
+       !(node->name = strdup(name)) )
+  { free(node);
+    return NULL;
+  }
+  tail = &node->children;
+
+  if ( depth > 0 )
+  { w->path[depth-1] = node->name;
+    if ( report_changes )
+      report(w, FUNCTOR_key_added1, depth, NULL, 0, NULL, 0);
+  }
+  RegQueryInfoKey(k, NULL, NULL, NULL, NULL, NULL, NULL,
+		  NULL, NULL, NULL, NULL, &node->written);
+  diff_values(w, k, node, depth, report_changes);
+
+  if ( depth >= MAX_WATCH_DEPTH )
+    return node;
+
+  for(i=0;;i++)
+  { char kname[256];
+    DWORD sk = sizeof(kname);
+    HKEY sub;
+
+    if ( w->stopping ||
+	 RegEnumKeyEx(k, i, kname, &sk, NULL, NULL, NULL,
+		      NULL) != ERROR_SUCCESS )
+      break;
+    if ( RegOpenKeyEx(k, kname, 0L, KEY_READ, &sub) == ERROR_SUCCESS )
+    { wkey *child = read_wkey(w, sub, kname, depth+1, report_changes);
+
+      RegCloseKey(sub);
+      if ( child )
+      { *tail = child;
+	tail = &child->next;
+      }
+    }
+  }
+
+  return node;
+}
+
+
+static wkey *
+take_wkey(wkey **list, const char *name)
+{ wkey **kp, *k;
+
+  for(kp=list; (k=*kp); kp=&k->next)
+  { if ( _stricmp(k->name, name) == 0 )
+    { *kp = k->next;
+      k->next = NULL;
+      return k;
+    }
+  }
+
+  return NULL;
+}
+
+/* Compare the key k with its snapshot node, updating the snapshot and
+   reporting the differences.
+*/
+
+static void
+diff_wkey(watcher *w, HKEY k, wkey *node, int depth)
+{ FILETIME written;
+  wkey *old = node->children;
+  wkey *new = NULL, **tail = &new;
+  int moved;
+  DWORD i;
+
+  if ( depth > 0 )
+    w->path[depth-1] = node->name;
+  if ( RegQueryInfoKey(k, NULL, NULL, NULL, NULL, NULL, NULL,
+		       NULL, NULL, NULL, NULL, &written) != ERROR_SUCCESS )
+    return;
+  if ( (moved = (CompareFileTime(&written, &node->written) != 0)) )
+  { node->written = written;
+    diff_values(w, k, node, depth, TRUE);
+  }
+  if ( depth >= MAX_WATCH_DEPTH )
+    return;
+
+  if ( !moved )				/* same subkeys; only descend */
+  { wkey *c;
+
+    for(c=node->children; c && !w->stopping; c=c->next)
+    { HKEY sub;
+
+      if ( RegOpenKeyEx(k, c->name, 0L, KEY_READ, &sub) == ERROR_SUCCESS )
+      { diff_wkey(w, sub, c, depth+1);
+	RegCloseKey(sub);
+      }
+    }
+    return;
+  }
+
+  for(i=0;;i++)
+  { char kname[256];
+    DWORD sk = sizeof(kname);
+    HKEY sub;
+    wkey *c;
+
+    if ( w->stopping ||
+	 RegEnumKeyEx(k, i, kname, &sk, NULL, NULL, NULL,
+		      NULL) != ERROR_SUCCESS )
+      break;
+    c = take_wkey(&old, kname);
+    if ( RegOpenKeyEx(k, kname, 0L, KEY_READ, &sub) == ERROR_SUCCESS )
+    { if ( c )
+	diff_wkey(w, sub, c, depth+1);
+      else
+	c = read_wkey(w, sub, kname, depth+1, TRUE);
+      RegCloseKey(sub);
+    }					/* else it still exists: keep c */
+    if ( c )
+    { *tail = c;
+      tail = &c->next;
+    }
+  }
+
+  for(; old; old=old->next)		/* remaining ones are deleted */
+  { w->path[depth] = old->name;
+    report(w, FUNCTOR_key_deleted1, depth+1, NULL, 0, NULL, 0);
+  }
+  free_wkeys(old);
+  node->children = new;
+}
+
+
+static DWORD
+notify_changes(watcher *w)
+{ return RegNotifyChangeKeyValue(w->root, TRUE,
+				 REG_NOTIFY_CHANGE_NAME|
+				 REG_NOTIFY_CHANGE_LAST_SET,
+				 w->changed, TRUE);
+}
+
+
+static DWORD WINAPI
+watch_thread(LPVOID closure)
+{ watcher *w = closure;
+  HANDLE events[2];
+  DWORD rval = ERROR_SUCCESS;
+
+  if ( PL_thread_attach_engine(NULL) < 0 )
+  { w->error = ERROR_NOT_ENOUGH_MEMORY;
+    SetEvent(w->ready);
+    return 1;
+  }
+
+  /* The caller waits for `ready`, so the initial content may only be
+     sent after it is signalled: the queue may be bounded and is read
+     by the caller.  Without initial(true) the snapshot must be
+     complete before we return to guarantee all later changes are
+     reported.
+  */
+  if ( (w->error = notify_changes(w)) == ERROR_SUCCESS &&
+       !w->initial &&
+       !(w->snapshot = read_wkey(w, w->root, "", 0, FALSE)) )
+    w->error = ERROR_NOT_ENOUGH_MEMORY;
+  SetEvent(w->ready);
+  if ( w->error != ERROR_SUCCESS )	/* raised by reg_watch_tree/3 */
+  { PL_thread_destroy_engine();
+    return 0;
+  }
+  if ( w->initial &&
+       !(w->snapshot = read_wkey(w, w->root, "", 0, TRUE)) )
+    rval = ERROR_NOT_ENOUGH_MEMORY;
+
+  events[0] = w->stop;
+  events[1] = w->changed;
+  while( rval == ERROR_SUCCESS && !w->stopping &&
+	 WaitForMultipleObjects(2, events, FALSE,
+				INFINITE) == WAIT_OBJECT_0+1 )
+  { if ( (rval=notify_changes(w)) != ERROR_SUCCESS )
+      break;
+    diff_wkey(w, w->root, w->snapshot, 0);
+  }
+					/* the watch is dead: tell */
+  if ( rval != ERROR_SUCCESS )
+    report_error(w, rval);
+
+  PL_thread_destroy_engine();
+  return 0;
+}
+
+
+static void
+free_watcher(watcher *w)
+{ if ( w->root )
+    RegCloseKey(w->root);
+  if ( w->changed )
+    CloseHandle(w->changed);
+  if ( w->stop )
+    CloseHandle(w->stop);
+  if ( w->ready )
+    CloseHandle(w->ready);
+  if ( w->thread )
+    CloseHandle(w->thread);
+  if ( w->queue )
+    PL_erase(w->queue);
+  free_wkeys(w->snapshot);
+  free(w->vname);
+  free_regbuf(&w->data);
+  free(w);
+}
+
+
+static void
+stop_watcher(watcher *w)
+{ SetEvent(w->stop);
+  WaitForSingleObject(w->thread, INFINITE);
+  free_watcher(w);
+}
+
+
+foreign_t
+pl_reg_watch_tree(term_t h, term_t queue, term_t options)
+{ HKEY k;
+  watcher *w;
+  term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t id   = PL_new_term_ref();
+  int initial = FALSE;
+  DWORD rval;
 
-  if ( !(k = to_key(h)) ||
-       !PL_get_atom_chars(name, &kname) ||
-       !PL_get_atom_chars(class, &cname) ||
-       !get_access(access, &mode) )
+  if ( !(k = to_key(h)) )
     PL_fail;
+  while(PL_get_list(tail, head, tail))
+  { if ( PL_is_functor(head, FUNCTOR_id1) )
+    { _PL_get_arg(1, head, id);
+    } else if ( PL_is_functor(head, FUNCTOR_initial1) )
+    { term_t a = PL_new_term_ref();
+
+      _PL_get_arg(1, head, a);
+      if ( !PL_get_bool(a, &initial) )
+	return PL_type_error("bool", a);
+    }
+  }
+  if ( !PL_get_nil(tail) )
+    return PL_type_error("list", options);
+
+  if ( !PRED_thread_send_message3 )
+    PRED_thread_send_message3 = PL_predicate("thread_send_message", 3,
+					     "system");
+  if ( !(w = calloc(1, sizeof(*w))) )
+    return PL_resource_error("memory");
+  init_regbuf(&w->data);
+  w->initial = initial;
+  w->queue = PL_record(queue);
+  if ( !(w->vname = malloc(MAX_VALUE_NAME)) ||
+       !grow_regbuf(&w->data, 256) ||
+       !(w->changed = CreateEvent(NULL, FALSE, FALSE, NULL)) ||
+       !(w->stop    = CreateEvent(NULL, TRUE,  FALSE, NULL)) ||
+       !(w->ready   = CreateEvent(NULL, TRUE,  FALSE, NULL)) )
+  { free_watcher(w);
+    return PL_resource_error("memory");
+  }
+  if ( (rval=RegOpenKeyEx(k, NULL, 0L, KEY_NOTIFY|KEY_READ,
+			  &w->root)) != ERROR_SUCCESS )
+  { w->root = 0;
+    free_watcher(w);
+    return api_exception(rval, "notify", h);
+  }
+
+  w->id = (int)InterlockedIncrement(&watch_id);
+  if ( !PL_unify_integer(id, w->id) )
+  { free_watcher(w);
+    return FALSE;
+  }
+  if ( !(w->thread = CreateThread(NULL, 0, watch_thread, w, 0, NULL)) )
+  { free_watcher(w);
+    return PL_resource_error("threads");
+  }
+  WaitForSingleObject(w->ready, INFINITE);
+  if ( w->error != ERROR_SUCCESS )
+  { rval = w->error;
+    stop_watcher(w);
+    return api_exception(rval, "notify", h);
+  }
+
+  EnterCriticalSection(&watch_lock);
+  w->next = watchers;
+  watchers = w;
+  LeaveCriticalSection(&watch_lock);
+
+  return TRUE;
+}
+
+
+foreign_t
+pl_reg_unwatch_tree(term_t id)
+{ int i;
+  watcher **wp, *w;
+
+  if ( !PL_get_integer(id, &i) )
+    return PL_type_error("integer", id);
+
+  EnterCriticalSection(&watch_lock);
+  for(wp=&watchers; (w=*wp); wp=&w->next)
+  { if ( w->id == i )
+    { *wp = w->next;
+      break;
+    }
+  }
+  LeaveCriticalSection(&watch_lock);
+
+  if ( !w )
+    return PL_existence_error("registry_watch", id);
+  stop_watcher(w);
+
+  PL_succeed;
+}
+
+
+		 /*******************************
+		 *	      TRACING		*
+		 *******************************/
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+reg_trace_start(+File, +Options)
+	Start recording the basic registry operations to File.  Options:
+
+	  - buffer_size(+Bytes)
+	    Size of the in-memory buffer.  Records are written to File
+	    when the buffer is full.  Default is 1Mb.
+reg_trace_stop
+	Stop recording and flush the buffer to the file.
+reg_trace_replay(+File, +Options, -Stats)
+	Replay a recorded trace below a sandbox key.  See regtrace.c for
+	how the operations are mapped.  Options:
+
+	  - root(+Key)
+	    Sandbox key.  Required.
+	  - speedup(+Factor)
+	    Replay Factor times faster than recorded.  If 0, replay
+	    without delays.  Default is 1.
+	  - threads(+Count)
+	    Number of replay threads.  Default is 1.
+
+	Stats is a list holding operations(Count), errors(Count),
+	skipped(Count) and time(Seconds).
+
+The wrappers below are registered  instead   of  the plain predicates.
+When tracing is disabled they only test a flag. reg_define_layout/2 and
+the tracing predicates do not access the registry and are not traced.
+The background work of reg_watch_tree/3  is   not  traced either; only
+setting up the watch is.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+static const char *
+trace_name(term_t t)
+{ char *s;
+
+  return PL_get_atom_chars(t, &s) ? s : NULL;
+}
+
+static int
+end_call(trace_call *tc, int rc)
+{ trace_end(tc, rc ? TR_SUCCESS : PL_exception(0) ? TR_ERROR : TR_FAILURE);
+
+  return rc;
+}
+
+static foreign_t
+traced_reg_subkeys(term_t h, term_t l)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_subkeys(h, l);
+  trace_begin(&tc, TR_SUBKEYS, to_key(h), NULL);
+  return end_call(&tc, pl_reg_subkeys(h, l));
+}
+
+static foreign_t
+traced_reg_subkeys3(term_t h, term_t l, term_t options)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_subkeys3(h, l, options);
+  trace_begin(&tc, TR_SUBKEYS, to_key(h), NULL);
+  return end_call(&tc, pl_reg_subkeys3(h, l, options));
+}
+
+static foreign_t
+traced_reg_open_key(term_t parent, term_t name, term_t access, term_t handle)
+{ trace_call tc;
+  int rc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_open_key(parent, name, access, handle);
+  trace_begin(&tc, TR_OPEN_KEY, to_key(parent), trace_name(name));
+  if ( (rc = pl_reg_open_key(parent, name, access, handle)) )
+    tc.result = to_key(handle);
+  return end_call(&tc, rc);
+}
+
+static foreign_t
+traced_reg_close_key(term_t h)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_close_key(h);
+  trace_begin(&tc, TR_CLOSE_KEY, to_key(h), NULL);
+  return end_call(&tc, pl_reg_close_key(h));
+}
+
+static foreign_t
+traced_reg_delete_key(term_t h, term_t sub)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_delete_key(h, sub);
+  trace_begin(&tc, TR_DELETE_KEY, to_key(h), trace_name(sub));
+  return end_call(&tc, pl_reg_delete_key(h, sub));
+}
+
+static foreign_t
+traced_reg_value_names(term_t h, term_t names)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_value_names(h, names);
+  trace_begin(&tc, TR_VALUE_NAMES, to_key(h), NULL);
+  return end_call(&tc, pl_reg_value_names(h, names));
+}
+
+static foreign_t
+traced_reg_value_names3(term_t h, term_t names, term_t options)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_value_names3(h, names, options);
+  trace_begin(&tc, TR_VALUE_NAMES, to_key(h), NULL);
+  return end_call(&tc, pl_reg_value_names3(h, names, options));
+}
+
+static foreign_t
+traced_reg_value(term_t h, term_t name, term_t value)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_value(h, name, value);
+  trace_begin(&tc, TR_VALUE, to_key(h), trace_name(name));
+  return end_call(&tc, pl_reg_value(h, name, value));
+}
+
+static foreign_t
+traced_reg_value4(term_t h, term_t name, term_t value, term_t options)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_value4(h, name, value, options);
+  trace_begin(&tc, TR_VALUE, to_key(h), trace_name(name));
+  return end_call(&tc, pl_reg_value4(h, name, value, options));
+}
+
+static foreign_t
+traced_reg_set_value(term_t h, term_t name, term_t value)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_set_value(h, name, value);
+  trace_begin(&tc, TR_SET_VALUE, to_key(h), trace_name(name));
+  return end_call(&tc, pl_reg_set_value(h, name, value));
+}
+
+static foreign_t
+traced_reg_delete_value(term_t h, term_t name)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_delete_value(h, name);
+  trace_begin(&tc, TR_DELETE_VALUE, to_key(h), trace_name(name));
+  return end_call(&tc, pl_reg_delete_value(h, name));
+}
+
+static foreign_t
+traced_reg_flush(term_t h)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_flush(h);
+  trace_begin(&tc, TR_FLUSH, to_key(h), NULL);
+  return end_call(&tc, pl_reg_flush(h));
+}
+
+static foreign_t
+traced_reg_create_key(term_t h, term_t name,
+		      term_t class, term_t options, term_t access,
+		      term_t key)
+{ trace_call tc;
+  int rc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_create_key(h, name, class, options, access, key);
+  trace_begin(&tc, TR_CREATE_KEY, to_key(h), trace_name(name));
+  if ( (rc = pl_reg_create_key(h, name, class, options, access, key)) )
+    tc.result = to_key(key);
+  return end_call(&tc, rc);
+}
+
+/* Put the components of the path A/B/... after its root in b as a
+   0-terminated string using \ as separator and the root in root.
+*/
+
+static int put_trace_path(term_t path, term_t root, regbuf *b);
+
+static int
+trace_path(term_t path, term_t root, regbuf *b)
+{ b->size = 0;
+
+  return ( put_trace_path(path, root, b) &&
+	   add_regbuf(b, "", 1) );
+}
+
+static int
+put_trace_path(term_t path, term_t root, regbuf *b)
+{ if ( PL_is_functor(path, FUNCTOR_divide2) )
+  { term_t a = PL_new_term_ref();
+    char *s;
+
+    _PL_get_arg(1, path, a);
+    if ( !put_trace_path(a, root, b) )
+      return FALSE;
+    _PL_get_arg(2, path, a);
+    if ( !PL_get_atom_chars(a, &s) )
+      return FALSE;
+
+    return ( (b->size == 0 || add_regbuf(b, "\\", 1)) &&
+	     add_regbuf(b, s, strlen(s)) );
+  }
 
+  return PL_put_term(root, path);
+}
+
+/* reg_get_values/2 is recorded as a TR_GET_VALUE record for each
+   request, all with the start time of the call.
+*/
+
+static foreign_t
+traced_reg_get_values(term_t requests, term_t results)
+{ trace_call tc;
+  LONGLONG start;
+  term_t tail, head, path, name, root;
+  regbuf b;
+  int rc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_get_values(requests, results);
+
+  start = trace_clock();
+  rc = pl_reg_get_values(requests, results);
+
+  tail = PL_copy_term_ref(requests);
+  head = PL_new_term_ref();
+  path = PL_new_term_ref();
+  name = PL_new_term_ref();
+  root = PL_new_term_ref();
+  init_regbuf(&b);
   while(PL_get_list(tail, head, tail))
-  { atom_t a;
+  { char *vname;
+
+    if ( !PL_is_functor(head, FUNCTOR_minus2) )
+      continue;
+    _PL_get_arg(1, head, path);
+    _PL_get_arg(2, head, name);
+    if ( PL_get_atom_chars(name, &vname) &&
+	 trace_path(path, root, &b) )
+    { trace_begin(&tc, TR_GET_VALUE, to_key(root), (char*)b.base);
+      tc.value = vname;
+      tc.start = start;
+      end_call(&tc, rc);
+    }
+  }
+  free_regbuf(&b);
 
-    if ( PL_get_atom(head, &a) )
-    { if ( a == ATOM_volatile )
-      {	ops &= ~REG_OPTION_NON_VOLATILE;
-	ops |= REG_OPTION_VOLATILE;
-	continue;
-      }
+  return rc;
+}
+
+/* reg_match/4 is recorded once, when it is called.
+*/
+
+static foreign_t
+traced_reg_match(term_t pattern, term_t name, term_t path, term_t value,
+		 control_t h)
+{ if ( reg_trace_enabled && PL_foreign_control(h) == PL_FIRST_CALL )
+  { term_t root = PL_new_term_ref();
+    trace_call tc;
+    char *vname;
+    regbuf b;
+
+    init_regbuf(&b);
+    if ( PL_get_atom_chars(name, &vname) &&
+	 trace_path(pattern, root, &b) )
+    { trace_begin(&tc, TR_MATCH, to_key(root), (char*)b.base);
+      tc.value = vname;
+      trace_end(&tc, TR_SUCCESS);
     }
+    free_regbuf(&b);
+  }
+
+  return pl_reg_match(pattern, name, path, value, h);
+}
+
+static foreign_t
+traced_reg_copy_tree(term_t from, term_t to, term_t options)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_copy_tree(from, to, options);
+  trace_begin(&tc, TR_COPY_TREE, to_key(from), NULL);
+  tc.result = to_key(to);
+  return end_call(&tc, pl_reg_copy_tree(from, to, options));
+}
+
+static foreign_t
+traced_reg_move_tree(term_t from, term_t to, term_t options)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_move_tree(from, to, options);
+  trace_begin(&tc, TR_MOVE_TREE, to_key(from), NULL);
+  tc.result = to_key(to);
+  return end_call(&tc, pl_reg_move_tree(from, to, options));
+}
+
+static foreign_t
+traced_reg_usage(term_t h, term_t options, term_t stats)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_usage(h, options, stats);
+  trace_begin(&tc, TR_USAGE, to_key(h), NULL);
+  return end_call(&tc, pl_reg_usage(h, options, stats));
+}
+
+static foreign_t
+traced_reg_decode(term_t h, term_t name, term_t spec, term_t term)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_decode(h, name, spec, term);
+  trace_begin(&tc, TR_DECODE, to_key(h), trace_name(name));
+  return end_call(&tc, pl_reg_decode(h, name, spec, term));
+}
+
+static foreign_t
+traced_reg_open_value_stream(term_t h, term_t name, term_t mode,
+			     term_t stream)
+{ trace_call tc;
+  atom_t a;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_open_value_stream(h, name, mode, stream);
+  trace_begin(&tc,
+	      PL_get_atom(mode, &a) && a == ATOM_read ? TR_READ_STREAM
+						      : TR_WRITE_STREAM,
+	      to_key(h), trace_name(name));
+  return end_call(&tc, pl_reg_open_value_stream(h, name, mode, stream));
+}
+
+static foreign_t
+traced_reg_save_key(term_t h, term_t file)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_save_key(h, file);
+  trace_begin(&tc, TR_SAVE_KEY, to_key(h), NULL);
+  return end_call(&tc, pl_reg_save_key(h, file));
+}
 
+static foreign_t
+traced_reg_restore_key(term_t h, term_t file, term_t options)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_restore_key(h, file, options);
+  trace_begin(&tc, TR_RESTORE_KEY, to_key(h), NULL);
+  return end_call(&tc, pl_reg_restore_key(h, file, options));
+}
+
+static foreign_t
+traced_reg_watch_tree(term_t h, term_t queue, term_t options)
+{ trace_call tc;
+
+  if ( !reg_trace_enabled )
+    return pl_reg_watch_tree(h, queue, options);
+  trace_begin(&tc, TR_WATCH_TREE, to_key(h), NULL);
+  return end_call(&tc, pl_reg_watch_tree(h, queue, options));
+}
+
+
+static foreign_t
+pl_reg_trace_start(term_t file, term_t options)
+{ char *fname;
+  size_t size = 1024*1024;
+  term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+  DWORD rval;
+
+  if ( !PL_get_file_name(file, &fname, PL_FILE_OSPATH) )
     PL_fail;
+  while(PL_get_list(tail, head, tail))
+  { if ( PL_is_functor(head, FUNCTOR_buffer_size1) )
+    { int64_t v;
+
+      _PL_get_arg(1, head, arg);
+      if ( !PL_get_int64(arg, &v) )
+	return PL_type_error("integer", arg);
+      if ( v <= 0 )
+	return PL_domain_error("positive_integer", arg);
+      size = (size_t)v;
+    }
   }
   if ( !PL_get_nil(tail) )
+    return PL_type_error("list", options);
+
+  if ( (rval=trace_start(fname, size)) == ERROR_SUCCESS )
+    PL_succeed;
+
+  return api_exception(rval, "trace", file);
+}
+
+
+static foreign_t
+pl_reg_trace_stop(void)
+{ DWORD rval;
+
+  if ( (rval=trace_stop()) == ERROR_SUCCESS )
+    PL_succeed;
+
+  return api_exception(rval, "trace", PL_new_term_ref());
+}
+
+
+static foreign_t
+pl_reg_trace_replay(term_t file, term_t options, term_t stats)
+{ char *fname;
+  replay_options ro;
+  replay_stats rs;
+  term_t tail = PL_copy_term_ref(options);
+  term_t head = PL_new_term_ref();
+  term_t arg  = PL_new_term_ref();
+  DWORD rval;
+
+  ro.root    = 0;
+  ro.speedup = 1.0;
+  ro.threads = 1;
+
+  if ( !PL_get_file_name(file, &fname, PL_FILE_OSPATH) )
     PL_fail;
+  while(PL_get_list(tail, head, tail))
+  { if ( PL_is_functor(head, FUNCTOR_root1) )
+    { _PL_get_arg(1, head, arg);
+      if ( !(ro.root = to_key(arg)) )
+	return PL_domain_error("registry_key", arg);
+    } else if ( PL_is_functor(head, FUNCTOR_speedup1) )
+    { _PL_get_arg(1, head, arg);
+      if ( !PL_get_float(arg, &ro.speedup) )
+	return PL_type_error("number", arg);
+      if ( ro.speedup < 0.0 )
+	return PL_domain_error("not_less_than_zero", arg);
+    } else if ( PL_is_functor(head, FUNCTOR_threads1) )
+    { _PL_get_arg(1, head, arg);
+      if ( !PL_get_integer(arg, &ro.threads) )
+	return PL_type_error("integer", arg);
+      if ( ro.threads < 1 )
+	return PL_domain_error("positive_integer", arg);
+    }
+  }
+  if ( !PL_get_nil(tail) )
+    return PL_type_error("list", options);
+  if ( !ro.root )
+  { term_t opt = PL_new_term_ref();
 
-  rval = RegCreateKeyEx(k, kname, 0L, cname, ops, mode, NULL, &skey, &disp);
-  if ( rval == ERROR_SUCCESS )
-    return PL_unify_integer(key, (int)(intptr_t)skey);
-  else
-    return api_exception(rval, "create", name);
+    return ( PL_put_atom_chars(opt, "root") &&
+	     PL_existence_error("option", opt) );
+  }
+
+  if ( (rval=trace_replay(fname, &ro, &rs)) != ERROR_SUCCESS )
+    return api_exception(rval, "replay", file);
+
+  return PL_unify_term(stats,
+		       PL_LIST, 4,
+			 PL_FUNCTOR_CHARS, "operations", 1,
+			   PL_INT64, rs.operations,
+			 PL_FUNCTOR_CHARS, "errors", 1,
+			   PL_INT64, rs.errors,
+			 PL_FUNCTOR_CHARS, "skipped", 1,
+			   PL_INT64, rs.skipped,
+			 PL_FUNCTOR_CHARS, "time", 1,
+			   PL_FLOAT, rs.time);
 }
 
+
 		 /*******************************
 		 *	     FLUSH SHELL	*
 		 *******************************/
@@ -720,16 +4964,41 @@ will makes these available in the calling context module.
 install_t
 install_plregtry()
 { init_constants();
-
-  PL_register_foreign("reg_subkeys",	 2, pl_reg_subkeys,	0);
-  PL_register_foreign("reg_open_key",	 4, pl_reg_open_key,	0);
-  PL_register_foreign("reg_close_key",	 1, pl_reg_close_key,	0);
-  PL_register_foreign("reg_delete_key",	 2, pl_reg_delete_key,	0);
-  PL_register_foreign("reg_value_names", 2, pl_reg_value_names, 0);
-  PL_register_foreign("reg_value",       3, pl_reg_value,       0);
-  PL_register_foreign("reg_set_value",   3, pl_reg_set_value,   0);
-  PL_register_foreign("reg_delete_value",2, pl_reg_delete_value,0);
-  PL_register_foreign("reg_flush",       1, pl_reg_flush,       0);
-  PL_register_foreign("reg_create_key",	 6, pl_reg_create_key,	0);
+  InitializeCriticalSection(&msg_cache_lock);
+  InitializeCriticalSection(&layout_lock);
+  InitializeCriticalSection(&privilege_lock);
+  InitializeCriticalSection(&watch_lock);
+  init_regtrace();
+
+  PL_register_foreign("reg_subkeys",	 2, traced_reg_subkeys,	0);
+  PL_register_foreign("reg_subkeys",	 3, traced_reg_subkeys3,0);
+  PL_register_foreign("reg_open_key",	 4, traced_reg_open_key,0);
+  PL_register_foreign("reg_close_key",	 1, traced_reg_close_key, 0);
+  PL_register_foreign("reg_delete_key",	 2, traced_reg_delete_key, 0);
+  PL_register_foreign("reg_value_names", 2, traced_reg_value_names, 0);
+  PL_register_foreign("reg_value_names", 3, traced_reg_value_names3, 0);
+  PL_register_foreign("reg_value",       3, traced_reg_value,   0);
+  PL_register_foreign("reg_value",       4, traced_reg_value4,  0);
+  PL_register_foreign("reg_set_value",   3, traced_reg_set_value, 0);
+  PL_register_foreign("reg_delete_value",2, traced_reg_delete_value, 0);
+  PL_register_foreign("reg_flush",       1, traced_reg_flush,   0);
+  PL_register_foreign("reg_create_key",	 6, traced_reg_create_key, 0);
+  PL_register_foreign("reg_open_value_stream", 4,
+		      traced_reg_open_value_stream, 0);
+  PL_register_foreign("reg_define_layout", 2, pl_reg_define_layout, 0);
+  PL_register_foreign("reg_decode",	 4, traced_reg_decode,	0);
+  PL_register_foreign("reg_usage",	 3, traced_reg_usage,	0);
+  PL_register_foreign("reg_copy_tree",	 3, traced_reg_copy_tree, 0);
+  PL_register_foreign("reg_move_tree",	 3, traced_reg_move_tree, 0);
+  PL_register_foreign("reg_match",	 4, traced_reg_match,
+		      PL_FA_NONDETERMINISTIC);
+  PL_register_foreign("reg_get_values",	 2, traced_reg_get_values, 0);
+  PL_register_foreign("reg_save_key",	 2, traced_reg_save_key, 0);
+  PL_register_foreign("reg_restore_key", 3, traced_reg_restore_key, 0);
+  PL_register_foreign("reg_trace_start", 2, pl_reg_trace_start, 0);
+  PL_register_foreign("reg_trace_stop",	 0, pl_reg_trace_stop,	0);
+  PL_register_foreign("reg_trace_replay",3, pl_reg_trace_replay,0);
+  PL_register_foreign("reg_watch_tree",	 3, traced_reg_watch_tree, 0);
+  PL_register_foreign("reg_unwatch_tree",1, pl_reg_unwatch_tree,0);
   PL_register_foreign("win_flush_filetypes", 0, win_flush_filetypes, 0);
 }
@@ -41,10 +41,27 @@ dlldemo directory.
 :- module(win_registry,
           [ registry_get_key/2,         % +Path, -Value
             registry_get_key/3,         % +Path, +Name, -Value
+            registry_get_key/4,         % +Path, +Name, -Value, +Options
+            registry_get_keys/2,        % +Requests, -Results
+            registry_open_value_stream/4, % +Path, +Name, +Mode, -Stream
+            registry_define_layout/2,   % +Name, +Layout
+            registry_decode/4,          % +Path, +Name, +Layout, -Term
             registry_set_key/2,         % +Path, +Value
             registry_set_key/3,         % +Path, +Name, +Value
             registry_delete_key/1,      % +Path
             registry_lookup_key/3,      % +Path, +Access, -Key
+            registry_match/3,           % +Pattern, -Path, -Value
+            registry_match/4,           % +Pattern, +Name, -Path, -Value
+            registry_usage/3,           % +Path, +Options, -Stats
+            registry_copy_tree/3,       % +From, +To, +Options
+            registry_move_tree/3,       % +From, +To, +Options
+            registry_save_key/2,        % +Path, +File
+            registry_restore_key/3,     % +Path, +File, +Options
+            registry_trace_start/2,     % +File, +Options
+            registry_trace_stop/0,
+            registry_trace_replay/3,    % +File, +Options, -Stats
+            registry_watch/3,           % +Path, +Queue, +Options
+            registry_unwatch/1,         % +Id
             win_flush_filetypes/0,      % Flush changes filetypes to shell
 
             shell_register_file_type/4, % +Ext, +Type, +Name, +Open
@@ -54,7 +71,7 @@ dlldemo directory.
                                         % +IfNotRunning
             shell_register_prolog/1     % +Extension
           ]).
-:- autoload(library(lists),[member/2]).
+:- autoload(library(lists),[member/2, selectchk/3]).
 
 :- use_foreign_library(foreign(plregtry)).      % load plregtry.ddl
 
@@ -159,21 +176,276 @@ registry_set_key(Path, Name, Value) :-
 
 %!  registry_get_key(+Path, -Value) is semidet.
 %!  registry_get_key(+Path, +Name, -Value) is semidet.
+%!  registry_get_key(+Path, +Name, -Value, +Options) is semidet.
 %
 %   Get the value associated with the given key.  If the key does not
-%   exists, the predicate fails silently.
+%   exists, the predicate fails silently.  Options:
+%
+%     - output(+Type)
+%       One of `atom` (default) or `string`.  Determines the Prolog
+%       type used for textual values.  Using `string` avoids creating
+%       atoms when reading many distinct values.
 
 registry_get_key(Path, Value) :-
     registry_get_key(Path, '', Value).
 registry_get_key(Path, Name, Value) :-
+    registry_get_key(Path, Name, Value, []).
+registry_get_key(Path, Name, Value, Options) :-
     registry_lookup_key(Path, read, Key, Close),
-    (   reg_value(Key, Name, RawVal)
+    (   reg_value(Key, Name, RawVal, Options)
     ->  Close,
         Value = RawVal
     ;   Close,
         fail
     ).
 
+%!  registry_open_value_stream(+Path, +Name, +Mode, -Stream) is semidet.
+%
+%   Open a binary stream on the data of the value Name of the key
+%   Path.  This avoids representing large values as a term.  Mode is
+%   one of `read`, `write` or write(Type), where Type is one of
+%   `binary` (default), `sz` or `expand_sz`.  A write stream stores
+%   the collected data as the new value when it is closed; for the
+%   string types a terminating 0-byte is added.  When reading, the
+%   predicate fails silently if the key does not exist.  When writing,
+%   missing keys are created.
+
+registry_open_value_stream(Path, Name, read, Stream) :-
+    !,
+    registry_lookup_key(Path, read, Key, Close),
+    call_cleanup(reg_open_value_stream(Key, Name, read, Stream), Close).
+registry_open_value_stream(Path, Name, Mode, Stream) :-
+    registry_make_key(Path, write, Key, Close),
+    call_cleanup(reg_open_value_stream(Key, Name, Mode, Stream), Close).
+
+%!  registry_define_layout(+Name, +Layout) is det.
+%!  registry_decode(+Path, +Name, +Layout, -Term) is semidet.
+%
+%   Decode a binary value that holds a packed C structure.  Layout is
+%   an integer type such as `u32le` or `i16be`, `utf16z` for a
+%   0-terminated UTF-16 string, bytes(N), skip(N), array(N, Layout),
+%   repeat(Layout), a list of layouts describing a structure or the
+%   name of a layout defined using registry_define_layout/2.  The
+%   layout is compiled once, so decoding many values is fast.  For
+%   example:
+%
+%   ==
+%   ?- registry_define_layout(point, [i32le, i32le]).
+%   ?- registry_decode(current_user/'Software'/demo, pos, point, P).
+%   P = [10, 20].
+%   ==
+%
+%   Terms are encoded using layout(Layout, Term) as value for
+%   registry_set_key/3.  registry_decode/4 fails if the key or value
+%   does not exist or the data does not match Layout.  The names of
+%   the built-in layouts cannot be redefined.
+
+registry_define_layout(Name, Layout) :-
+    reg_define_layout(Name, Layout).
+
+registry_decode(Path, Name, Layout, Term) :-
+    registry_lookup_key(Path, read, Key, Close),
+    call_cleanup(reg_decode(Key, Name, Layout, Term), Close).
+
+%!  registry_get_keys(+Requests, -Results) is det.
+%
+%   Read multiple values at once.  Requests is a list of Path-Name
+%   pairs.  Results is a list of the same length, holding value(Value)
+%   for each value found and `missing` if the key or value does not
+%   exist.  Keys shared by multiple paths are opened only once, which
+%   makes this much faster than calling registry_get_key/3 for each
+%   value when the paths have common prefixes.
+
+registry_get_keys(Requests, Results) :-
+    reg_get_values(Requests, Results).
+
+%!  registry_match(+Pattern, -Path, -Value) is nondet.
+%!  registry_match(+Pattern, +Name, -Path, -Value) is nondet.
+%
+%   True when Path is a key that matches Pattern and Value is the
+%   value Name of this key.  registry_match/3 uses the default value
+%   ('').  Keys that do not have the value are skipped.  Pattern is a
+%   path whose components may be `*` (any key), `**` (any sequence of
+%   zero or more keys) or a glob pattern using `*`, `?` and `[...]`.
+%   For example, to find all open commands:
+%
+%   ==
+%   ?- registry_match(classes_root/'*'/shell/open/command, Path, Cmd).
+%   ==
+%
+%   The pattern is resolved in C.  Plain components are opened
+%   directly rather than by enumerating their parent.  Each matching
+%   key is returned once, also if Pattern contains multiple `**`
+%   components.  Values of a type that has no Prolog representation
+%   are returned as binary(Bytes).
+
+registry_match(Pattern, Path, Value) :-
+    reg_match(Pattern, '', Path, Value).
+registry_match(Pattern, Name, Path, Value) :-
+    reg_match(Pattern, Name, Path, Value).
+
+%!  registry_usage(+Path, +Options, -Stats) is semidet.
+%
+%   Compute the size of the tree below Path.  Fails silently if Path
+%   does not exist.  Stats is a list holding keys(Count),
+%   values(Count), bytes(Count) for the total size of the value data,
+%   max_depth(Depth), denied(Count) for the number of keys that could
+%   not be opened, types(List) holding Type-Bytes for each value type
+%   and largest(List).  The latter is a list of child(Name, Stats)
+%   terms describing the largest subkeys, largest first.  Options:
+%
+%     - threads(+Count)
+%       Number of threads used.  Default is the number of processors.
+%     - top(+Count)
+%       Number of subkeys in each largest(List).  Default is 10.
+%     - depth(+Depth)
+%       Depth to which largest(List) is reported.  Default is 1,
+%       i.e., only the subkeys of Path.
+%
+%   The tree is walked in C by multiple threads, which makes this
+%   much faster than walking it using registry_get_key/3 and friends.
+
+registry_usage(Path, Options, Stats) :-
+    registry_lookup_key(Path, read, Key, Close),
+    call_cleanup(reg_usage(Key, Options, Stats), Close).
+
+%!  registry_copy_tree(+From, +To, +Options) is semidet.
+%!  registry_move_tree(+From, +To, +Options) is semidet.
+%
+%   Copy all values and subkeys of the key From to the key To, which
+%   is created if it does not exist.  registry_move_tree/3 deletes
+%   the subkeys and values of From after a successful copy.  Both fail
+%   silently if From does not exist and raise a permission error if
+%   From and To are the same key or one is below the other.  Options:
+%
+%     - if_exists(+Action)
+%       What to do with values that already exist in To.  One of
+%       `merge` (default, values of From replace those of To), `skip`
+%       (keep the value of To) or `overwrite` (a subkey of To that
+%       also appears in From is emptied before copying into it).
+%       Values and subkeys of To that do not appear in From are never
+%       deleted.
+
+registry_copy_tree(From, To, Options) :-
+    registry_tree_op(From, read, To, Src, Dst,
+                     reg_copy_tree(Src, Dst, Options)).
+
+registry_move_tree(From, To, Options) :-
+    registry_tree_op(From, all_access, To, Src, Dst,
+                     reg_move_tree(Src, Dst, Options)).
+
+registry_tree_op(From, Access, To, Src, Dst, Goal) :-
+    registry_lookup_key(From, Access, Src, CloseSrc),
+    call_cleanup(( registry_make_key(To, all_access, Dst, CloseDst),
+                   call_cleanup(Goal, CloseDst)
+                 ),
+                 CloseSrc).
+
+%!  registry_save_key(+Path, +File) is semidet.
+%!  registry_restore_key(+Path, +File, +Options) is det.
+%
+%   Save the key Path with all its subkeys and values to File in the
+%   native registry hive format, or replace the content of Path by the
+%   content of such a file.  File may not exist when saving.
+%   registry_save_key/2 fails silently if Path does not exist and
+%   registry_restore_key/3 creates Path if needed.  The data is never
+%   represented in Prolog.  Options for restoring:
+%
+%     - force(+Bool)
+%       Restore even if there are open handles to subkeys of Path.
+%     - volatile(+Bool)
+%       Make the restored data volatile.  Only valid for keys directly
+%       below `local_machine` or `users`.
+%
+%   These predicates need SeBackupPrivilege and SeRestorePrivilege,
+%   which are held by administrators.  If a privilege is not held, a
+%   permission error is raised.
+
+registry_save_key(Path, File) :-
+    registry_lookup_key(Path, read, Key, Close),
+    call_cleanup(reg_save_key(Key, File), Close).
+
+registry_restore_key(Path, File, Options) :-
+    registry_make_key(Path, all_access, Key, Close),
+    call_cleanup(reg_restore_key(Key, File, Options), Close).
+
+%!  registry_trace_start(+File, +Options) is det.
+%!  registry_trace_stop is det.
+%
+%   Record the registry operations of all threads to File, such that
+%   they can be replayed using registry_trace_replay/3.  Options:
+%
+%     - buffer_size(+Bytes)
+%       Size of the in-memory buffer.  Records are written to File
+%       when the buffer is full.  Default is 1Mb.
+%
+%   registry_trace_stop/0 stops recording and flushes the buffer.
+
+registry_trace_start(File, Options) :-
+    reg_trace_start(File, Options).
+
+registry_trace_stop :-
+    reg_trace_stop.
+
+%!  registry_trace_replay(+File, +Options, -Stats) is det.
+%
+%   Replay a trace recorded using registry_trace_start/2 below a
+%   sandbox key, for example to measure the registry load of an
+%   application.  Stats is a list holding operations(Count),
+%   errors(Count), skipped(Count) and time(Seconds).  Options:
+%
+%     - root(+Path)
+%       Sandbox key, which is created if it does not exist.  Required.
+%     - speedup(+Factor)
+%       Replay Factor times faster than recorded.  If 0, replay
+%       without delays.  Default is 1.
+%     - threads(+Count)
+%       Number of replay threads.  Default is 1.
+
+registry_trace_replay(File, Options0, Stats) :-
+    selectchk(root(Path), Options0, Options),
+    !,
+    registry_make_key(Path, all_access, Root, Close),
+    call_cleanup(reg_trace_replay(File, [root(Root)|Options], Stats),
+                 Close).
+registry_trace_replay(File, Options, Stats) :-
+    reg_trace_replay(File, Options, Stats).
+
+%!  registry_watch(+Path, +Queue, +Options) is det.
+%!  registry_unwatch(+Id) is det.
+%
+%   Send a term registry_change(Id, Event) to the message queue Queue
+%   for each change to the tree below Path.  Event is one of
+%   key_added(Keys), key_deleted(Keys), value_added(Keys, Name, Value),
+%   value_changed(Keys, Name, Value) or value_deleted(Keys, Name), where
+%   Keys is the list of key names relative to Path.  This allows for
+%   keeping a copy of a subtree up-to-date without re-reading it.  If
+%   watching fails, for example because Path is deleted, the event
+%   watch_error(Message) is sent and no further events follow, so the
+%   copy may be stale.  The watch must still be removed using
+%   registry_unwatch/1.
+%   Options:
+%
+%     - id(-Id)
+%       Unify Id with the identifier needed by registry_unwatch/1.
+%     - initial(+Bool)
+%       If `true`, first send events that describe the current
+%       content of the tree.  These are sent after registry_watch/3
+%       returns, so Queue may be bounded and read by the caller.
+%
+%   If Queue is full, sending waits until there is room;
+%   registry_unwatch/1 aborts such a wait.
+%
+%   Only keys whose last-write time changed are re-read after a
+%   change is signalled.
+
+registry_watch(Path, Queue, Options) :-
+    registry_lookup_key(Path, notify, Key, Close),
+    call_cleanup(reg_watch_tree(Key, Queue, Options), Close).
+
+registry_unwatch(Id) :-
+    reg_unwatch_tree(Id).
+
 %!  registry_delete_key(+Path)
 %
 %   Delete the gven key and all its subkeys and values.  Note that
@@ -0,0 +1,1024 @@
+/*  Part of SWI-Prolog
+
+    WWW:           http://www.swi-prolog.org
+    Copyright (c)  2026, SWI-Prolog contributors
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in
+       the documentation and/or other materials provided with the
+       distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+    ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+
+#include "regtrace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Registry operation trace recorder and replay driver.
+
+While tracing is enabled, each traced  predicate   adds  a record to an
+in-memory buffer that is written to the trace  file when it is full and
+when tracing is stopped. A trace file  starts   with  a header and holds
+records in the order in which the operations completed:
+
+  header: "PLRT" u32:version u64:counter_frequency
+  record: u8:op u8:status u16:name_length u32:thread
+	  u64:start u32:duration u32:type u32:size
+	  u64:key u64:result name_bytes
+
+All integers are little endian. Times are in performance counter ticks,
+start relative to the start of the trace. If a record has both a path and
+a value name (TR_GET_VALUE and TR_MATCH), name_bytes holds the path, a
+0-byte and the value name.  Paths use \ as separator.
+
+The replay driver runs a trace against a sandbox key. The predefined root
+keys are mapped to subkeys of the sandbox with the same name as used by
+library(registry).  Keys that were opened successfully are created, such
+that the sandbox acquires the shape of the recorded tree.  Written values
+are replaced by zero-filled data of the recorded type and size.  Saves
+and restores are counted as skipped because the hive files are not part
+of the trace.
+
+Operations of the same recorded thread are replayed in order by the same
+replay thread.  As a handle may be opened in one thread and used in
+another, load_trace() resolves each handle in a record to its generation:
+the index of the record that opened it.  A handle value that is reused
+after a close thus gets a new generation.  A record that uses a handle
+waits until the record that opened it has been replayed and a close waits
+until all uses of the generation before it in the trace are replayed.  As
+these records precede the waiting one in the trace and each worker
+replays its records in trace order, this cannot deadlock.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+#define TRACE_MAGIC	    "PLRT"
+#define TRACE_VERSION	    1
+#define TRACE_FILE_HEADER   16
+#define TRACE_RECORD_HEADER 44
+#define TRACE_MAX_NAME	    0xffff
+
+volatile LONG reg_trace_enabled = 0;
+
+static CRITICAL_SECTION trace_lock;
+static FILE	       *trace_fd;	/* output file */
+static BYTE	       *trace_buf;	/* record buffer */
+static size_t		trace_size;	/* allocated size of trace_buf */
+static size_t		trace_fill;	/* used part of trace_buf */
+static LONGLONG		trace_epoch;	/* counter at start of trace */
+
+static THREAD_LOCAL trace_call *current_call;
+
+void
+init_regtrace(void)
+{ InitializeCriticalSection(&trace_lock);
+}
+
+		 /*******************************
+		 *	     ENCODING		*
+		 *******************************/
+
+static void
+put_u16(BYTE *p, unsigned int v)
+{ p[0] = (BYTE)(v);
+  p[1] = (BYTE)(v>>8);
+}
+
+static void
+put_u32(BYTE *p, uint32_t v)
+{ put_u16(p, v&0xffff);
+  put_u16(p+2, v>>16);
+}
+
+static void
+put_u64(BYTE *p, uint64_t v)
+{ put_u32(p, (uint32_t)(v&0xffffffff));
+  put_u32(p+4, (uint32_t)(v>>32));
+}
+
+static unsigned int
+get_u16(const BYTE *p)
+{ return p[0] | (p[1]<<8);
+}
+
+static uint32_t
+get_u32(const BYTE *p)
+{ return get_u16(p) | ((uint32_t)get_u16(p+2)<<16);
+}
+
+static uint64_t
+get_u64(const BYTE *p)
+{ return get_u32(p) | ((uint64_t)get_u32(p+4)<<32);
+}
+
+static LONGLONG
+counter(void)
+{ LARGE_INTEGER now;
+
+  QueryPerformanceCounter(&now);
+  return now.QuadPart;
+}
+
+		 /*******************************
+		 *	      RECORDER		*
+		 *******************************/
+
+static int
+flush_trace(void)
+{ int rc = TRUE;
+
+  if ( trace_fill > 0 )
+  { rc = (fwrite(trace_buf, 1, trace_fill, trace_fd) == trace_fill);
+    trace_fill = 0;
+  }
+
+  return rc;
+}
+
+
+DWORD
+trace_start(const char *file, size_t buffer_size)
+{ BYTE header[TRACE_FILE_HEADER];
+  LARGE_INTEGER freq;
+  DWORD rc = ERROR_SUCCESS;
+
+  if ( buffer_size < TRACE_RECORD_HEADER+TRACE_MAX_NAME )
+    buffer_size = TRACE_RECORD_HEADER+TRACE_MAX_NAME;
+
+  EnterCriticalSection(&trace_lock);
+  if ( trace_fd )
+  { rc = ERROR_BUSY;
+  } else if ( !(trace_buf = malloc(buffer_size)) )
+  { rc = ERROR_NOT_ENOUGH_MEMORY;
+  } else if ( !(trace_fd = fopen(file, "wb")) )
+  { free(trace_buf);
+    trace_buf = NULL;
+    rc = ERROR_OPEN_FAILED;
+  } else
+  { QueryPerformanceFrequency(&freq);
+    memcpy(header, TRACE_MAGIC, 4);
+    put_u32(header+4, TRACE_VERSION);
+    put_u64(header+8, (uint64_t)freq.QuadPart);
+    fwrite(header, 1, sizeof(header), trace_fd);
+
+    trace_size  = buffer_size;
+    trace_fill  = 0;
+    trace_epoch = counter();
+    reg_trace_enabled = TRUE;
+  }
+  LeaveCriticalSection(&trace_lock);
+
+  return rc;
+}
+
+
+DWORD
+trace_stop(void)
+{ DWORD rc = ERROR_SUCCESS;
+
+  EnterCriticalSection(&trace_lock);
+  reg_trace_enabled = FALSE;
+  if ( trace_fd )
+  { if ( !flush_trace() )
+      rc = ERROR_WRITE_FAULT;
+    if ( fclose(trace_fd) != 0 )
+      rc = ERROR_WRITE_FAULT;
+    trace_fd = NULL;
+    free(trace_buf);
+    trace_buf = NULL;
+  }
+  LeaveCriticalSection(&trace_lock);
+
+  return rc;
+}
+
+
+LONGLONG
+trace_clock(void)
+{ return counter();
+}
+
+
+void
+trace_begin(trace_call *tc, trace_op op, HKEY key, const char *name)
+{ tc->op     = op;
+  tc->key    = key;
+  tc->name   = name;
+  tc->value  = NULL;
+  tc->type   = 0;
+  tc->size   = 0;
+  tc->result = 0;
+  tc->start  = counter();
+
+  current_call = tc;
+}
+
+
+void
+trace_data(DWORD type, size_t size)
+{ trace_call *tc;
+
+  if ( (tc=current_call) )
+  { tc->type = type;
+    tc->size = (DWORD)size;
+  }
+}
+
+
+void
+trace_end(trace_call *tc, trace_status status)
+{ BYTE header[TRACE_RECORD_HEADER];
+  LONGLONG now = counter();
+  LONGLONG duration = now - tc->start;
+  size_t namelen = tc->name ? strlen(tc->name) : 0;
+  size_t valuelen = tc->value ? strlen(tc->value)+1 : 0;
+
+  current_call = NULL;
+  namelen += valuelen;
+  if ( namelen > TRACE_MAX_NAME )	/* drop the value name, truncate */
+  { namelen -= valuelen;
+    valuelen = 0;
+    if ( namelen > TRACE_MAX_NAME )
+      namelen = TRACE_MAX_NAME;
+  }
+  if ( duration > 0xffffffff )
+    duration = 0xffffffff;
+
+  header[0] = (BYTE)tc->op;
+  header[1] = (BYTE)status;
+  put_u16(header+2, (unsigned int)namelen);
+  put_u32(header+4, GetCurrentThreadId());
+  put_u32(header+16, (uint32_t)duration);
+  put_u32(header+20, tc->type);
+  put_u32(header+24, tc->size);
+  put_u64(header+28, (uint64_t)(uintptr_t)tc->key);
+  put_u64(header+36, (uint64_t)(uintptr_t)tc->result);
+
+  EnterCriticalSection(&trace_lock);
+  if ( trace_fd )
+  { put_u64(header+8, (uint64_t)(tc->start - trace_epoch));
+    if ( trace_fill + sizeof(header) + namelen > trace_size )
+      flush_trace();
+    memcpy(trace_buf+trace_fill, header, sizeof(header));
+    trace_fill += sizeof(header);
+    if ( namelen )
+    { size_t plen = namelen - valuelen;
+
+      memcpy(trace_buf+trace_fill, tc->name, plen);
+      if ( valuelen )
+      { trace_buf[trace_fill+plen] = 0;
+	memcpy(trace_buf+trace_fill+plen+1, tc->value, valuelen-1);
+      }
+      trace_fill += namelen;
+    }
+  }
+  LeaveCriticalSection(&trace_lock);
+}
+
+		 /*******************************
+		 *	       REPLAY		*
+		 *******************************/
+
+#define NO_GEN		(-1)		/* unknown handle */
+#define ROOT_GEN(i)	(-2-(i))	/* predefined root i */
+#define IS_ROOT_GEN(g)	((g) <= -2)
+#define ROOT_INDEX(g)	(-2-(g))
+#define ROOT_COUNT	4
+#define MAX_VALUE_NAME	16384
+
+typedef struct trec
+{ trace_op	op;			/* operation */
+  trace_status	status;			/* recorded status */
+  int		worker;			/* replay thread */
+  LONGLONG	start;			/* start time (ticks) */
+  DWORD		type;			/* value type */
+  DWORD		size;			/* value size */
+  uint64_t	key;			/* recorded key */
+  uint64_t	result;			/* recorded result key */
+  int		kgen;			/* generation of key */
+  int		dgen;			/* generation of copy target */
+  LONG		uses;			/* close: # uses of kgen before it */
+  char	       *name;			/* 0-terminated name */
+  char	       *value;			/* 0-terminated value name */
+} trec;
+
+#define MAP_BUCKETS 4096
+
+typedef struct gen_entry
+{ uint64_t	   recorded;		/* recorded handle */
+  int		   gen;			/* its current generation */
+  struct gen_entry *next;		/* next in bucket */
+} gen_entry;
+
+typedef struct replay
+{ trec		   *records;		/* parsed records */
+  size_t	    count;		/* # records */
+  char		   *names;		/* name pool */
+  LONGLONG	    frequency;		/* recorded ticks per second */
+  LONGLONG	    local_frequency;	/* our ticks per second */
+  LONGLONG	    epoch;		/* counter at start of replay */
+  const replay_options *options;
+  int		    nthreads;		/* # replay threads */
+  HKEY		    roots[ROOT_COUNT];	/* sandbox keys for the roots */
+  HKEY		   *live;		/* live handle per generation */
+  volatile LONG	   *done;		/* record has been replayed */
+  volatile LONG	   *used;		/* # replayed uses per generation */
+} replay;
+
+typedef struct replay_worker
+{ replay	   *replay;		/* the replay */
+  int		    id;			/* worker id */
+  BYTE		   *data;		/* value buffer */
+  size_t	    datasize;		/* size of data */
+  char		   *vname;		/* value name buffer */
+  replay_stats	    stats;		/* statistics */
+} replay_worker;
+
+static const struct root_key
+{ HKEY key;
+  const char *name;
+} root_keys[ROOT_COUNT+1] =
+{ { HKEY_CLASSES_ROOT,  "classes_root" },
+  { HKEY_CURRENT_USER,  "current_user" },
+  { HKEY_LOCAL_MACHINE, "local_machine" },
+  { HKEY_USERS,		"users" },
+  { 0,			NULL }
+};
+
+
+		 /*******************************
+		 *	    GENERATIONS		*
+		 *******************************/
+
+static unsigned int
+map_hash(uint64_t recorded)
+{ return (unsigned int)((recorded ^ (recorded>>17)) % MAP_BUCKETS);
+}
+
+static gen_entry **
+map_find(gen_entry **map, uint64_t recorded)
+{ gen_entry **ep, *e;
+
+  for(ep=&map[map_hash(recorded)]; (e=*ep); ep=&e->next)
+  { if ( e->recorded == recorded )
+      break;
+  }
+
+  return ep;
+}
+
+static int
+lookup_gen(gen_entry **map, uint64_t recorded)
+{ gen_entry *e = *map_find(map, recorded);
+  int i;
+
+  if ( e )
+    return e->gen;
+  for(i=0; root_keys[i].name; i++)
+  { if ( (uint64_t)(uintptr_t)root_keys[i].key == recorded )
+      return ROOT_GEN(i);
+  }
+
+  return NO_GEN;
+}
+
+/* Resolve the recorded handles of all records to generations.  This
+   runs over the records in trace order, so a handle always refers to
+   the most recent open that returned it.
+*/
+
+static DWORD
+resolve_generations(replay *rp)
+{ gen_entry **map = calloc(MAP_BUCKETS, sizeof(*map));
+  LONG *uses = calloc(rp->count ? rp->count : 1, sizeof(*uses));
+  DWORD rc = ERROR_SUCCESS;
+  size_t i;
+
+  if ( !map || !uses )
+    rc = ERROR_NOT_ENOUGH_MEMORY;
+
+  for(i=0; rc == ERROR_SUCCESS && i<rp->count; i++)
+  { trec *r = &rp->records[i];
+
+    r->kgen = lookup_gen(map, r->key);
+    r->dgen = ( r->op == TR_COPY_TREE || r->op == TR_MOVE_TREE
+		  ? lookup_gen(map, r->result) : NO_GEN );
+
+    if ( r->op == TR_CLOSE_KEY )
+    { if ( r->kgen >= 0 )
+      { gen_entry **ep = map_find(map, r->key);
+	gen_entry *e = *ep;
+
+	r->uses = uses[r->kgen];
+	*ep = e->next;
+	free(e);
+      }
+      continue;
+    }
+
+    if ( r->kgen >= 0 )
+      uses[r->kgen]++;
+    if ( r->dgen >= 0 )
+      uses[r->dgen]++;
+
+    if ( (r->op == TR_OPEN_KEY || r->op == TR_CREATE_KEY) &&
+	 r->status == TR_SUCCESS )
+    { gen_entry **ep = map_find(map, r->result);
+      gen_entry *e;
+
+      if ( (e = *ep) )
+      { e->gen = (int)i;		/* handle was not closed */
+      } else if ( (e = malloc(sizeof(*e))) )
+      { e->recorded = r->result;
+	e->gen = (int)i;
+	e->next = NULL;
+	*ep = e;
+      } else
+	rc = ERROR_NOT_ENOUGH_MEMORY;
+    }
+  }
+
+  if ( map )
+  { for(i=0; i<MAP_BUCKETS; i++)
+    { gen_entry *e, *next;
+
+      for(e=map[i]; e; e=next)
+      { next = e->next;
+	free(e);
+      }
+    }
+    free(map);
+  }
+  free(uses);
+
+  return rc;
+}
+
+static void
+await_value(volatile LONG *flag, LONG value)
+{ while( *flag < value )
+    Sleep(0);
+}
+
+/* Live handle for gen or 0 if it is unknown or could not be opened.
+   Waits for the record that opened it.
+*/
+
+static HKEY
+gen_key(replay *rp, int gen)
+{ if ( IS_ROOT_GEN(gen) )
+    return rp->roots[ROOT_INDEX(gen)];
+  if ( gen == NO_GEN )
+    return 0;
+
+  await_value(&rp->done[gen], 1);
+  return rp->live[gen];
+}
+
+static void
+release_gen(replay *rp, int gen)
+{ if ( gen >= 0 )
+    InterlockedIncrement(&rp->used[gen]);
+}
+
+
+		 /*******************************
+		 *	     LOADING		*
+		 *******************************/
+
+static void
+free_replay(replay *rp)
+{ size_t i;
+
+  for(i=0; i<ROOT_COUNT; i++)
+  { if ( rp->roots[i] )
+      RegCloseKey(rp->roots[i]);
+  }
+  if ( rp->live )
+  { for(i=0; i<rp->count; i++)
+    { if ( rp->live[i] )
+	RegCloseKey(rp->live[i]);
+    }
+  }
+  free(rp->live);
+  free((void*)rp->done);
+  free((void*)rp->used);
+  free(rp->records);
+  free(rp->names);
+}
+
+
+static DWORD
+load_trace(const char *file, replay *rp)
+{ FILE *fd;
+  BYTE *data = NULL;
+  long size;
+  size_t here, namesize = 0, n = 0;
+  char *np;
+  uint32_t threads[256];
+  int nthreads = 0;
+  DWORD rc = ERROR_SUCCESS;
+
+  if ( !(fd = fopen(file, "rb")) )
+    return ERROR_FILE_NOT_FOUND;
+  if ( fseek(fd, 0, SEEK_END) != 0 ||
+       (size = ftell(fd)) < TRACE_FILE_HEADER ||
+       fseek(fd, 0, SEEK_SET) != 0 )
+  { fclose(fd);
+    return ERROR_INVALID_DATA;
+  }
+  if ( !(data = malloc(size)) )
+  { fclose(fd);
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  if ( fread(data, 1, size, fd) != (size_t)size )
+    rc = ERROR_READ_FAULT;
+  fclose(fd);
+
+  if ( rc == ERROR_SUCCESS &&
+       (memcmp(data, TRACE_MAGIC, 4) != 0 ||
+	get_u32(data+4) != TRACE_VERSION) )
+    rc = ERROR_INVALID_DATA;
+
+					/* count records and name space */
+  for(here=TRACE_FILE_HEADER; rc == ERROR_SUCCESS && here < (size_t)size; n++)
+  { size_t namelen;
+
+    if ( here+TRACE_RECORD_HEADER > (size_t)size )
+    { rc = ERROR_INVALID_DATA;
+      break;
+    }
+    namelen = get_u16(data+here+2);
+    here += TRACE_RECORD_HEADER+namelen;
+    namesize += namelen+1;
+  }
+  if ( rc == ERROR_SUCCESS && here != (size_t)size )
+    rc = ERROR_INVALID_DATA;
+
+  if ( rc == ERROR_SUCCESS )
+  { size_t slots = n ? n : 1;
+
+    rp->frequency = (LONGLONG)get_u64(data+8);
+    rp->count = n;
+    if ( !(rp->records = malloc(slots*sizeof(trec))) ||
+	 !(rp->names = malloc(namesize ? namesize : 1)) ||
+	 !(rp->live = calloc(slots, sizeof(HKEY))) ||
+	 !(rp->done = calloc(slots, sizeof(LONG))) ||
+	 !(rp->used = calloc(slots, sizeof(LONG))) )
+      rc = ERROR_NOT_ENOUGH_MEMORY;
+  }
+
+  np = rp->names;
+  for(here=TRACE_FILE_HEADER, n=0; rc == ERROR_SUCCESS && n < rp->count; n++)
+  { const BYTE *p = data+here;
+    trec *r = &rp->records[n];
+    size_t namelen = get_u16(p+2);
+    uint32_t thread = get_u32(p+4);
+    size_t plen;
+    int i;
+
+    r->op     = (trace_op)p[0];
+    r->status = (trace_status)p[1];
+    r->start  = (LONGLONG)get_u64(p+8);
+    r->type   = get_u32(p+20);
+    r->size   = get_u32(p+24);
+    r->key    = get_u64(p+28);
+    r->result = get_u64(p+36);
+    r->uses   = 0;
+    r->name   = np;
+    memcpy(np, p+TRACE_RECORD_HEADER, namelen);
+    np[namelen] = '\0';
+    plen = strlen(np);			/* path\0value */
+    r->value  = (plen < namelen ? np+plen+1 : np+namelen);
+    np += namelen+1;
+    here += TRACE_RECORD_HEADER+namelen;
+
+    for(i=0; i<nthreads; i++)		/* number recorded threads */
+    { if ( threads[i] == thread )
+	break;
+    }
+    if ( i == nthreads && nthreads < 256 )
+      threads[nthreads++] = thread;
+    r->worker = i;
+  }
+
+  free(data);
+  if ( rc == ERROR_SUCCESS )
+    rc = resolve_generations(rp);
+
+  return rc;
+}
+
+
+		 /*******************************
+		 *	      REPLAYING		*
+		 *******************************/
+
+static BYTE *
+worker_buffer(replay_worker *w, size_t size)
+{ if ( size > w->datasize )
+  { BYTE *new = realloc(w->data, size);
+
+    if ( !new )
+      return NULL;
+    w->data = new;
+    w->datasize = size;
+  }
+  if ( w->data )
+    memset(w->data, 0, size);
+
+  return w->data ? w->data : (BYTE*)"";
+}
+
+
+static DWORD
+read_value(replay_worker *w, HKEY key, const char *name, DWORD size)
+{ DWORD type, rval;
+  BYTE *data;
+
+  if ( !(data = worker_buffer(w, size)) )
+    return ERROR_NOT_ENOUGH_MEMORY;
+  rval = RegQueryValueEx(key, name, NULL, &type, data, &size);
+  if ( rval == ERROR_MORE_DATA || rval == ERROR_FILE_NOT_FOUND )
+    rval = ERROR_SUCCESS;		/* sandbox differs from original */
+
+  return rval;
+}
+
+
+static DWORD
+enum_subkeys(HKEY key)
+{ DWORD i, rval;
+
+  for(i=0;;i++)
+  { char name[256];
+    DWORD size = sizeof(name);
+
+    if ( (rval=RegEnumKeyEx(key, i, name, &size,
+			    NULL, NULL, NULL, NULL)) != ERROR_SUCCESS )
+      return rval == ERROR_NO_MORE_ITEMS ? ERROR_SUCCESS : rval;
+  }
+}
+
+
+static DWORD
+enum_values(replay_worker *w, HKEY key)
+{ DWORD i, rval;
+
+  for(i=0;;i++)
+  { DWORD size = MAX_VALUE_NAME;
+
+    if ( (rval=RegEnumValue(key, i, w->vname, &size,
+			    NULL, NULL, NULL, NULL)) != ERROR_SUCCESS )
+      return rval == ERROR_NO_MORE_ITEMS ? ERROR_SUCCESS : rval;
+  }
+}
+
+
+/* Walk the tree below key as reg_usage/3 does
+*/
+
+static void
+walk_tree(replay_worker *w, HKEY key)
+{ DWORD i;
+
+  enum_values(w, key);
+  for(i=0;;i++)
+  { char name[256];
+    DWORD size = sizeof(name);
+    HKEY sub;
+
+    if ( RegEnumKeyEx(key, i, name, &size,
+		      NULL, NULL, NULL, NULL) != ERROR_SUCCESS )
+      break;
+    if ( RegOpenKeyEx(key, name, 0L, KEY_READ, &sub) == ERROR_SUCCESS )
+    { walk_tree(w, sub);
+      RegCloseKey(sub);
+    }
+  }
+}
+
+
+/* Search for the pattern A\B\... as reg_match/4 does and read the value
+   of each matching key.
+*/
+
+static void
+replay_match(replay_worker *w, HKEY key, const char *pattern,
+	     const char *value)
+{ const char *sep;
+  char comp[256];
+  size_t len;
+  HKEY sub;
+
+  if ( !*pattern )
+  { read_value(w, key, value, 0);
+    return;
+  }
+
+  sep = strchr(pattern, '\\');
+  len = sep ? (size_t)(sep-pattern) : strlen(pattern);
+  if ( len >= sizeof(comp) )
+    return;
+  memcpy(comp, pattern, len);
+  comp[len] = 0;
+
+  if ( strcmp(comp, "**") == 0 || strpbrk(comp, "*?[") )
+  { int any = (strcmp(comp, "**") == 0);
+    const char *rest = sep ? sep+1 : "";
+    DWORD i;
+
+    if ( any )
+      replay_match(w, key, rest, value);
+    for(i=0;;i++)
+    { char name[256];
+      DWORD size = sizeof(name);
+
+      if ( RegEnumKeyEx(key, i, name, &size,
+			NULL, NULL, NULL, NULL) != ERROR_SUCCESS )
+	break;
+      if ( !any && !glob_match(comp, name) )
+	continue;
+      if ( RegOpenKeyEx(key, name, 0L, KEY_READ, &sub) == ERROR_SUCCESS )
+      { replay_match(w, sub, any ? pattern : rest, value);
+	RegCloseKey(sub);
+      }
+    }
+  } else if ( RegOpenKeyEx(key, comp, 0L, KEY_READ, &sub) == ERROR_SUCCESS )
+  { replay_match(w, sub, sep ? sep+1 : "", value);
+    RegCloseKey(sub);
+  }
+}
+
+
+static DWORD
+replay_op(replay_worker *w, size_t index, HKEY key)
+{ replay *rp = w->replay;
+  const trec *r = &rp->records[index];
+  HKEY sub;
+  DWORD rval;
+
+  switch(r->op)
+  { case TR_OPEN_KEY:
+    case TR_CREATE_KEY:
+      if ( r->status == TR_SUCCESS )
+      { DWORD disp;
+
+	if ( (rval=RegCreateKeyEx(key, r->name, 0L, NULL,
+				  REG_OPTION_NON_VOLATILE, KEY_ALL_ACCESS,
+				  NULL, &sub, &disp)) != ERROR_SUCCESS )
+	  return rval;
+	rp->live[index] = sub;
+	return ERROR_SUCCESS;
+      }
+      if ( (rval=RegOpenKeyEx(key, r->name, 0L,
+			      KEY_READ, &sub)) == ERROR_SUCCESS )
+	RegCloseKey(sub);
+      return ERROR_SUCCESS;		/* failure was expected */
+    case TR_DELETE_KEY:
+      return RegDeleteKey(key, r->name);
+    case TR_SUBKEYS:
+      return enum_subkeys(key);
+    case TR_VALUE_NAMES:
+      return enum_values(w, key);
+    case TR_VALUE:
+    case TR_DECODE:
+    case TR_READ_STREAM:
+      return read_value(w, key, r->name, r->size);
+    case TR_SET_VALUE:
+    { BYTE *data;
+
+      if ( !(data = worker_buffer(w, r->size)) )
+	return ERROR_NOT_ENOUGH_MEMORY;
+      return RegSetValueEx(key, r->name, 0L, r->type, data, r->size);
+    }
+    case TR_DELETE_VALUE:
+      rval = RegDeleteValue(key, r->name);
+      return rval == ERROR_FILE_NOT_FOUND ? ERROR_SUCCESS : rval;
+    case TR_FLUSH:
+      return RegFlushKey(key);
+    case TR_GET_VALUE:
+      if ( !r->name[0] )
+	return read_value(w, key, r->value, r->size);
+      if ( (rval=RegOpenKeyEx(key, r->name, 0L,
+			      KEY_READ, &sub)) == ERROR_SUCCESS )
+      { rval = read_value(w, sub, r->value, r->size);
+	RegCloseKey(sub);
+	return rval;
+      }
+      return rval == ERROR_FILE_NOT_FOUND ? ERROR_SUCCESS : rval;
+    case TR_MATCH:
+      replay_match(w, key, r->name, r->value);
+      return ERROR_SUCCESS;
+    case TR_COPY_TREE:
+    case TR_MOVE_TREE:
+    { HKEY dst = gen_key(rp, r->dgen);
+
+      if ( !dst )
+      { w->stats.skipped++;
+	return ERROR_SUCCESS;
+      }
+      if ( (rval=RegCopyTree(key, NULL, dst)) == ERROR_SUCCESS &&
+	   r->op == TR_MOVE_TREE )
+	rval = RegDeleteTree(key, NULL);
+      return rval;
+    }
+    case TR_USAGE:
+      walk_tree(w, key);
+      return ERROR_SUCCESS;
+    case TR_WRITE_STREAM:
+    case TR_WATCH_TREE:
+      if ( (rval=RegOpenKeyEx(key, NULL, 0L,
+			      r->op == TR_WATCH_TREE ? KEY_NOTIFY
+						     : KEY_SET_VALUE,
+			      &sub)) == ERROR_SUCCESS )
+	RegCloseKey(sub);
+      return rval;
+    case TR_SAVE_KEY:			/* hive files are not traced */
+    case TR_RESTORE_KEY:
+      w->stats.skipped++;
+      return ERROR_SUCCESS;
+    default:
+      return ERROR_INVALID_DATA;
+  }
+}
+
+
+static DWORD
+replay_record(replay_worker *w, size_t index)
+{ replay *rp = w->replay;
+  const trec *r = &rp->records[index];
+  HKEY key;
+  DWORD rval = ERROR_SUCCESS;
+
+  if ( r->op == TR_CLOSE_KEY )
+  { if ( r->kgen >= 0 )
+    { gen_key(rp, r->kgen);
+      await_value(&rp->used[r->kgen], r->uses);
+      if ( rp->live[r->kgen] )
+      { RegCloseKey(rp->live[r->kgen]);
+	rp->live[r->kgen] = 0;
+      }
+    }
+    return ERROR_SUCCESS;
+  }
+
+  if ( (key = gen_key(rp, r->kgen)) )
+    rval = replay_op(w, index, key);
+  else
+    w->stats.skipped++;
+
+  release_gen(rp, r->kgen);
+  release_gen(rp, r->dgen);
+
+  return rval;
+}
+
+
+static DWORD WINAPI
+replay_thread(LPVOID closure)
+{ replay_worker *w = closure;
+  replay *rp = w->replay;
+  double speedup = rp->options->speedup;
+  size_t i;
+
+  for(i=0; i<rp->count; i++)
+  { const trec *r = &rp->records[i];
+
+    if ( r->worker % rp->nthreads != w->id )
+      continue;
+
+    if ( speedup > 0.0 )
+    { double at  = (double)r->start/(double)rp->frequency/speedup;
+      double now = (double)(counter()-rp->epoch)/(double)rp->local_frequency;
+
+      if ( at > now )
+	Sleep((DWORD)((at-now)*1000.0));
+    }
+
+    if ( replay_record(w, i) != ERROR_SUCCESS )
+      w->stats.errors++;
+    w->stats.operations++;
+    InterlockedExchange(&rp->done[i], 1);
+  }
+
+  return 0;
+}
+
+
+DWORD
+trace_replay(const char *file, const replay_options *options,
+	     replay_stats *stats)
+{ replay rp;
+  replay_worker *workers;
+  HANDLE *threads;
+  LARGE_INTEGER freq;
+  DWORD rc;
+  int i;
+
+  memset(&rp, 0, sizeof(rp));
+  memset(stats, 0, sizeof(*stats));
+  rp.options = options;
+
+  if ( (rc=load_trace(file, &rp)) != ERROR_SUCCESS )
+  { free_replay(&rp);
+    return rc;
+  }
+  QueryPerformanceFrequency(&freq);
+  rp.local_frequency = freq.QuadPart;
+  if ( rp.frequency <= 0 )
+    rp.frequency = rp.local_frequency;
+
+  for(i=0; i<ROOT_COUNT; i++)		/* map roots into the sandbox */
+  { DWORD disp;
+
+    if ( (rc=RegCreateKeyEx(options->root, root_keys[i].name, 0L, NULL,
+			    REG_OPTION_NON_VOLATILE, KEY_ALL_ACCESS,
+			    NULL, &rp.roots[i], &disp)) != ERROR_SUCCESS )
+    { rp.roots[i] = 0;
+      free_replay(&rp);
+      return rc;
+    }
+  }
+
+  workers = calloc(options->threads, sizeof(*workers));
+  threads = calloc(options->threads, sizeof(*threads));
+  if ( !workers || !threads )
+  { free(workers);
+    free(threads);
+    free_replay(&rp);
+    return ERROR_NOT_ENOUGH_MEMORY;
+  }
+  for(i=0; i<options->threads; i++)
+  { if ( !(workers[i].vname = malloc(MAX_VALUE_NAME)) )
+    { while(--i >= 0)
+	free(workers[i].vname);
+      free(workers);
+      free(threads);
+      free_replay(&rp);
+      return ERROR_NOT_ENOUGH_MEMORY;
+    }
+  }
+
+					/* workers wait for each other, */
+  rp.nthreads = 1;			/* so all must run: use the */
+  for(i=0; i<options->threads; i++)	/* threads we can create */
+  { workers[i].replay = &rp;
+    workers[i].id = i;
+    if ( i > 0 )			/* we are worker 0 */
+    { if ( !(threads[i] = CreateThread(NULL, 0, replay_thread, &workers[i],
+				       CREATE_SUSPENDED, NULL)) )
+	break;
+      rp.nthreads++;
+    }
+  }
+  rp.epoch = counter();
+  for(i=1; i<rp.nthreads; i++)
+    ResumeThread(threads[i]);
+  replay_thread(&workers[0]);
+  for(i=1; i<rp.nthreads; i++)
+  { WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+  }
+  stats->time = (double)(counter()-rp.epoch)/(double)rp.local_frequency;
+
+  for(i=0; i<options->threads; i++)
+  { stats->operations += workers[i].stats.operations;
+    stats->errors     += workers[i].stats.errors;
+    stats->skipped    += workers[i].stats.skipped;
+    free(workers[i].data);
+    free(workers[i].vname);
+  }
+  free(workers);
+  free(threads);
+  free_replay(&rp);
+
+  return ERROR_SUCCESS;
+}
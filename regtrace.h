@@ -0,0 +1,116 @@
+/*  Part of SWI-Prolog
+
+    WWW:           http://www.swi-prolog.org
+    Copyright (c)  2026, SWI-Prolog contributors
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions
+    are met:
+
+    1. Redistributions of source code must retain the above copyright
+       notice, this list of conditions and the following disclaimer.
+
+    2. Redistributions in binary form must reproduce the above copyright
+       notice, this list of conditions and the following disclaimer in
+       the documentation and/or other materials provided with the
+       distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+    FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+    COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+    INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+    BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+    LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+    CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+    LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+    ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef REGTRACE_H_INCLUDED
+#define REGTRACE_H_INCLUDED
+
+#include <windows.h>
+#include <stdint.h>
+
+/* - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+Recording registry operations and replaying them.  The recorder does not
+depend on Prolog, such that replay can be driven from C as well.
+- - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - */
+
+typedef enum
+{ TR_OPEN_KEY = 1,
+  TR_CLOSE_KEY,
+  TR_CREATE_KEY,
+  TR_DELETE_KEY,
+  TR_SUBKEYS,
+  TR_VALUE_NAMES,
+  TR_VALUE,
+  TR_SET_VALUE,
+  TR_DELETE_VALUE,
+  TR_FLUSH,
+  TR_GET_VALUE,				/* one value of reg_get_values/2 */
+  TR_MATCH,
+  TR_COPY_TREE,
+  TR_MOVE_TREE,
+  TR_USAGE,
+  TR_DECODE,
+  TR_READ_STREAM,
+  TR_WRITE_STREAM,
+  TR_SAVE_KEY,
+  TR_RESTORE_KEY,
+  TR_WATCH_TREE
+} trace_op;
+
+typedef enum
+{ TR_SUCCESS = 0,
+  TR_FAILURE,
+  TR_ERROR
+} trace_status;
+
+typedef struct trace_call
+{ trace_op	op;			/* TR_* */
+  LONGLONG	start;			/* performance counter at start */
+  HKEY		key;			/* key operated on */
+  const char   *name;			/* subkey or value name */
+  const char   *value;			/* value name if name is a path */
+  DWORD		type;			/* value type */
+  DWORD		size;			/* value size */
+  HKEY		result;			/* opened, created or target key */
+} trace_call;
+
+typedef struct replay_options
+{ HKEY		root;			/* sandbox for the replay */
+  double	speedup;		/* time scale; 0: no delays */
+  int		threads;		/* # replay threads */
+} replay_options;
+
+typedef struct replay_stats
+{ int64_t	operations;		/* # operations replayed */
+  int64_t	errors;			/* # operations that failed */
+  int64_t	skipped;		/* # operations on unknown keys */
+  double	time;			/* wall time in seconds */
+} replay_stats;
+
+extern volatile LONG reg_trace_enabled;
+
+extern void  init_regtrace(void);
+extern DWORD trace_start(const char *file, size_t buffer_size);
+extern DWORD trace_stop(void);
+extern LONGLONG trace_clock(void);
+extern void  trace_begin(trace_call *tc, trace_op op,
+			 HKEY key, const char *name);
+extern void  trace_data(DWORD type, size_t size);
+extern void  trace_end(trace_call *tc, trace_status status);
+extern DWORD trace_replay(const char *file, const replay_options *options,
+			  replay_stats *stats);
+
+extern int   glob_match(const char *pattern, const char *s); /* plregtry.c */
+
+#define TRACE_DATA(type, size) \
+	do { if ( reg_trace_enabled ) trace_data(type, size); } while(0)
+
+#endif /*REGTRACE_H_INCLUDED*/